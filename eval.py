@@ -14,9 +14,16 @@ tf.app.flags.DEFINE_string('gpu_list', '0', '')
 tf.app.flags.DEFINE_string('checkpoint_path', '/tmp/east_icdar2015_resnet_v1_50_rbox/', '')
 tf.app.flags.DEFINE_string('output_dir', '/tmp/ch4_test_images/images/', '')
 tf.app.flags.DEFINE_bool('no_write_images', False, 'do not write images')
+tf.app.flags.DEFINE_integer('tile_size', 0, 'run the net on overlapping tiles of this size (a multiple of 32) '
+                            'at full resolution instead of shrinking large images; 0 disables')
+tf.app.flags.DEFINE_integer('tile_overlap', 256, 'overlap of neighbouring tiles; should exceed the text height')
+tf.app.flags.DEFINE_string('record_path', '', 'append the score map, geo map and pre-NMS boxes of every image '
+                           'to this record file, for lanms/replay')
+tf.app.flags.DEFINE_string('trace_path', '', 'write a Chrome trace of the latest images to this file at the end')
+tf.app.flags.DEFINE_string('nms_iou_kernel', 'clipper', 'IoU implementation of the NMS: clipper, or the faster '
+                           'closed-form convex_quad')
 
 import model
-from icdar import restore_rectangle
 
 FLAGS = tf.app.flags.FLAGS
 
@@ -69,7 +76,8 @@ def resize_image(im, max_side_len=2400):
     return im, (ratio_h, ratio_w)
 
 
-def detect(score_map, geo_map, timer, score_map_thresh=0.8, box_thresh=0.1, nms_thres=0.2):
+def detect(score_map, geo_map, timer, score_map_thresh=0.8, box_thresh=0.1, nms_thres=0.2, recorder=None,
+           nms_stats=None, iou_kernel='clipper'):
     '''
     restore text boxes from score map and geo map
     :param score_map:
@@ -78,42 +86,91 @@ def detect(score_map, geo_map, timer, score_map_thresh=0.8, box_thresh=0.1, nms_
     :param score_map_thresh: threshhold for score map
     :param box_thresh: threshhold for boxes
     :param nms_thres: threshold for nms
+    :param recorder: a lanms.RecordWriter to dump the inputs of this frame to
+    :param nms_stats: a dict to receive the NMS counters, see lanms.merge_quadrangle_n9
+    :param iou_kernel: IoU implementation of the NMS, see lanms.merge_quadrangle_n9
     :return:
     '''
     if len(score_map.shape) == 4:
         score_map = score_map[0, :, :, 0]
         geo_map = geo_map[0, :, :, ]
-    # filter the score map
-    xy_text = np.argwhere(score_map > score_map_thresh)
-    # sort the text boxes via the y axis
-    xy_text = xy_text[np.argsort(xy_text[:, 0])]
-    # restore
+    if recorder is not None:
+        with lanms.trace_span('record'):
+            recorder.write(score_map, geo_map, lanms.restore_rbox_maps(score_map, geo_map, score_map_thresh),
+                           score_map_thresh, nms_thres, box_thresh)
+    # filter the score map, restore the text boxes and run nms in one native
+    # row-major pass, so the boxes reach the merger sorted via the y axis
     start = time.time()
-    text_box_restored = restore_rectangle(xy_text[:, ::-1]*4, geo_map[xy_text[:, 0], xy_text[:, 1], :]) # N*4*2
-    print('{} text boxes before nms'.format(text_box_restored.shape[0]))
-    boxes = np.zeros((text_box_restored.shape[0], 9), dtype=np.float32)
-    boxes[:, :8] = text_box_restored.reshape((-1, 8))
-    boxes[:, 8] = score_map[xy_text[:, 0], xy_text[:, 1]]
-    timer['restore'] = time.time() - start
-    # nms part
-    start = time.time()
-    # boxes = nms_locality.nms_locality(boxes.astype(np.float64), nms_thres)
-    boxes = lanms.merge_quadrangle_n9(boxes.astype('float32'), nms_thres)
+    boxes = lanms.merge_rbox_maps(score_map, geo_map, score_map_thresh, nms_thres,
+                                  iou_kernel=iou_kernel, stats=nms_stats)
     timer['nms'] = time.time() - start
 
     if boxes.shape[0] == 0:
         return None, timer
 
     # here we filter some low score boxes by the average score map, this is different from the orginal paper
-    for i, box in enumerate(boxes):
-        mask = np.zeros_like(score_map, dtype=np.uint8)
-        cv2.fillPoly(mask, box[:8].reshape((-1, 4, 2)).astype(np.int32) // 4, 1)
-        boxes[i, 8] = cv2.mean(score_map, mask)[0]
+    boxes = lanms.rescore_quadrangle_n9(boxes, score_map)
     boxes = boxes[boxes[:, 8] > box_thresh]
 
     return boxes, timer
 
 
+def tile_rects(h, w, tile_size, overlap):
+    '''
+    cover an image with overlapping tiles; the last row and column of tiles
+    are aligned to the image border, so every tile is full sized
+    :return: list of tile areas (x0, y0, x1, y1)
+    '''
+    stride = max(tile_size - overlap, 32)
+
+    def starts(size):
+        last = max(size - tile_size, 0)
+        return list(range(0, last, stride)) + [last]
+
+    return [(x0, y0, min(x0 + tile_size, w), min(y0 + tile_size, h))
+            for y0 in starts(h) for x0 in starts(w)]
+
+
+def detect_tiled(sess, f_score, f_geometry, input_images, im, timer, tile_size, tile_overlap,
+                 nms_thres=0.2, recorder=None, iou_kernel='clipper'):
+    '''
+    detect text on overlapping tiles of the full resolution image, so the
+    memory used by the net is bounded by the tile size, and stitch the boxes
+    :param im: the image, not resized
+    :return: n*9 boxes in image coordinates, or None
+    '''
+    h, w, _ = im.shape
+    # boxes and area of each tile that has any
+    tiles, rects = [], []
+    for x0, y0, x1, y1 in tile_rects(h, w, tile_size, tile_overlap):
+        # pad to a multiple of 32 instead of resizing, to keep the scale
+        tile = np.zeros((int(math.ceil((y1 - y0) / 32.)) * 32, int(math.ceil((x1 - x0) / 32.)) * 32, 3),
+                        dtype=im.dtype)
+        tile[:y1 - y0, :x1 - x0] = im[y0:y1, x0:x1]
+        start = time.time()
+        with lanms.trace_span('sess.run'):
+            score, geometry = sess.run([f_score, f_geometry], feed_dict={input_images: [tile]})
+        timer['net'] += time.time() - start
+
+        boxes, tile_timer = detect(score_map=score, geo_map=geometry, timer={}, nms_thres=nms_thres,
+                                   recorder=recorder, iou_kernel=iou_kernel)
+        timer['nms'] += tile_timer['nms']
+        if boxes is None:
+            continue
+        boxes[:, 0:8:2] += x0
+        boxes[:, 1:8:2] += y0
+        tiles.append(boxes)
+        rects.append((x0, y0, x1, y1))
+
+    if not tiles:
+        return None, timer
+    # duplicates can only come from neighbouring tiles, in their overlap
+    start = time.time()
+    boxes = lanms.stitch_tiles(tiles, rects, nms_thres, iou_kernel=iou_kernel)
+    timer['nms'] += time.time() - start
+    return (boxes if boxes.shape[0] else None), timer
+
+
 def sort_poly(p):
     min_axis = np.argmin(np.sum(p, axis=1))
     p = p[[min_axis, (min_axis+1)%4, (min_axis+2)%4, (min_axis+3)%4]]
@@ -149,20 +206,35 @@ def main(argv=None):
             print('Restore from {}'.format(model_path))
             saver.restore(sess, model_path)
 
+            recorder = lanms.RecordWriter(FLAGS.record_path) if FLAGS.record_path else None
+            if FLAGS.trace_path:
+                lanms.trace_enable()
             im_fn_list = get_images()
             for im_fn in im_fn_list:
-                im = cv2.imread(im_fn)[:, :, ::-1]
+                with lanms.trace_span('decode'):
+                    im = cv2.imread(im_fn)[:, :, ::-1]
                 start_time = time.time()
-                im_resized, (ratio_h, ratio_w) = resize_image(im)
-
-                timer = {'net': 0, 'restore': 0, 'nms': 0}
-                start = time.time()
-                score, geometry = sess.run([f_score, f_geometry], feed_dict={input_images: [im_resized]})
-                timer['net'] = time.time() - start
-
-                boxes, timer = detect(score_map=score, geo_map=geometry, timer=timer)
-                print('{} : net {:.0f}ms, restore {:.0f}ms, nms {:.0f}ms'.format(
-                    im_fn, timer['net']*1000, timer['restore']*1000, timer['nms']*1000))
+                timer = {'net': 0, 'nms': 0}
+                if FLAGS.tile_size:
+                    ratio_h = ratio_w = 1.
+                    with lanms.trace_span('detect_tiled'):
+                        boxes, timer = detect_tiled(sess, f_score, f_geometry, input_images, im, timer,
+                                                    FLAGS.tile_size, FLAGS.tile_overlap, recorder=recorder,
+                                                    iou_kernel=FLAGS.nms_iou_kernel)
+                else:
+                    with lanms.trace_span('resize'):
+                        im_resized, (ratio_h, ratio_w) = resize_image(im)
+
+                    start = time.time()
+                    with lanms.trace_span('sess.run'):
+                        score, geometry = sess.run([f_score, f_geometry], feed_dict={input_images: [im_resized]})
+                    timer['net'] = time.time() - start
+
+                    with lanms.trace_span('detect'):
+                        boxes, timer = detect(score_map=score, geo_map=geometry, timer=timer, recorder=recorder,
+                                              iou_kernel=FLAGS.nms_iou_kernel)
+                print('{} : net {:.0f}ms, nms {:.0f}ms'.format(
+                    im_fn, timer['net']*1000, timer['nms']*1000))
 
                 if boxes is not None:
                     boxes = boxes[:, :8].reshape((-1, 4, 2))
@@ -193,5 +265,8 @@ def main(argv=None):
                     img_path = os.path.join(FLAGS.output_dir, os.path.basename(im_fn))
                     cv2.imwrite(img_path, im[:, :, ::-1])
 
+            if FLAGS.trace_path:
+                lanms.trace_dump(FLAGS.trace_path)
+
 if __name__ == '__main__':
     tf.app.run()
\ No newline at end of file
@@ -1,6 +1,7 @@
-
 import subprocess
 import os
+import struct
+import threading
 import numpy as np
 
 BASE_DIR = os.path.dirname(os.path.realpath(__file__))
@@ -8,13 +9,428 @@ BASE_DIR = os.path.dirname(os.path.realpath(__file__))
 if subprocess.call(['make', '-C', BASE_DIR]) != 0:  # return value
     raise RuntimeError('Cannot compile lanms: {}'.format(BASE_DIR))
 
+# reusable scratch memory: pass one as `workspace` to run frame after frame
+# without heap allocations; calls sharing one run one at a time, so use one
+# per thread to run them in parallel
+from .adaptor import Workspace  # noqa: E402
+# names of the generators of synthetic_workload
+from .adaptor import WORKLOADS  # noqa: E402
+# the clock of the trace timeline, in nanoseconds
+from .adaptor import trace_now, trace_record as _trace_record  # noqa: E402
+
+_tracing = False
+
+
+def merge_quadrangle_n9(polys, thres=0.3, precision=10000, iou_kernel='clipper',
+                        nms_mode='sequential', num_threads=0, parallel_locality=False,
+                        locality_2d=False, max_output=0, min_score=float('-inf'),
+                        workspace=None, stats=None):
+    '''
+    :param polys: n*9 quadrangles and scores, y-sorted; float32 C-contiguous
+        input is used as is, without a copy
+    :param precision: unused; coordinates are no longer quantised
+    :param iou_kernel: 'clipper' for general polygons, or 'convex_quad' for
+        the allocation-free kernel that only handles convex quadrangles
+        (non-convex ones still fall back to clipper)
+    :param nms_mode: 'sequential', or 'bitmask' to compute the suppression
+        relation on several threads first; both keep the same quadrangles
+    :param num_threads: worker threads of the parallel passes, 0 for one per core
+    :param parallel_locality: run the locality-aware first pass in horizontal
+        stripes on several threads; the input must be y-sorted as usual, and
+        the result is identical to the serial pass
+    :param locality_2d: let the first pass also merge a quadrangle into the
+        groups of the rows above it, so far fewer candidates reach the final
+        NMS; always serial, and the result differs slightly from the row-only
+        merge
+    :param max_output: return at most this many quadrangles, the best
+        scoring ones; the final NMS stops as soon as it has them. 0 for all
+    :param min_score: drop merged quadrangles scoring below this before the
+        final NMS computes any IoU. The score of a merged quadrangle is the
+        sum of the scores of the quadrangles merged into it, so this is a
+        floor on that sum, not on their mean
+    :param workspace: a Workspace to take the scratch memory from; the
+        result then shares its output buffer, which the next call reuses
+        only if no earlier result still refers to it
+    :param stats: a dict to receive the counters of the call: input,
+        after_locality, merges, iou_evals, aabb_rejects and kept counts,
+        and locality_ns, nms_setup_ns and nms_suppress_ns phase times. Not
+        collected at all when None
+    '''
+    from .adaptor import merge_quadrangle_n9 as nms_impl, IoUKernel, NmsMode
+    if len(polys) == 0:
+        return np.array([], dtype='float32')
+    if workspace is not None:
+        nms_impl = workspace.merge_quadrangle_n9
+    return nms_impl(polys, thres, getattr(IoUKernel, iou_kernel),
+                    getattr(NmsMode, nms_mode), num_threads, parallel_locality, locality_2d,
+                    max_output, min_score, stats)
+
 
-def merge_quadrangle_n9(polys, thres=0.3, precision=10000):
-    from .adaptor import merge_quadrangle_n9 as nms_impl
+def merge_quadrangle_n9_policy(polys, thres=0.3, iou_kernel='clipper', merge='weighted',
+                               suppression='hard', sigma=0.5, **kwargs):
+    '''
+    merge_quadrangle_n9 with a choice of policies, each combination being
+    compiled on its own
+    :param iou_kernel: 'clipper' or 'convex_quad'
+    :param merge: how the first pass merges overlapping quadrangles:
+        'weighted' (score-weighted vertices, summed scores), 'max_score'
+        (weighted vertices, the best score) or 'keep_best' (the best one)
+    :param suppression: 'hard', or the soft 'linear' and 'gaussian' rules,
+        which return every quadrangle with a decayed score
+    :param sigma: spread of the gaussian suppression
+    :param kwargs: nms_mode, num_threads, parallel_locality, locality_2d,
+        max_output and min_score, as in merge_quadrangle_n9; soft suppression
+        also drops quadrangles once decayed below min_score
+    '''
+    from . import adaptor
+    from .adaptor import NmsMode
     if len(polys) == 0:
         return np.array([], dtype='float32')
-    p = polys.copy()
-    p[:,:8] *= precision
-    ret = np.array(nms_impl(p, thres), dtype='float32')
-    ret[:,:8] /= precision
-    return ret
+    impl = getattr(adaptor, 'merge_quadrangle_n9_{}_{}_{}'.format(iou_kernel, merge, suppression))
+    if 'nms_mode' in kwargs:
+        kwargs['nms_mode'] = getattr(NmsMode, kwargs['nms_mode'])
+    return impl(polys, thres, sigma, **kwargs)
+
+
+def merge_quadrangle_n9_batch(polys_list, thres=0.3, num_threads=0, precision=10000,
+                              iou_kernel='clipper', nms_mode='sequential'):
+    '''
+    merge_quadrangle_n9 over several images at once; the GIL is released and
+    images are spread over a persistent native thread pool
+    :param polys_list: list of n*9 arrays, one per image
+    :param num_threads: worker threads, 0 for one per core
+    :param precision: unused, as in merge_quadrangle_n9
+    :return: list of merged n*9 arrays
+    '''
+    from .adaptor import merge_quadrangle_n9_batch as batch_impl, IoUKernel, NmsMode
+    ps = [np.asarray(polys, dtype='float32').reshape((-1, 9)) for polys in polys_list]
+    ret = batch_impl(ps, thres, getattr(IoUKernel, iou_kernel),
+                     getattr(NmsMode, nms_mode), num_threads)
+    return [r if len(polys) else np.array([], dtype='float32')
+            for r, polys in zip(ret, polys_list)]
+
+
+def stitch_tiles(polys_list, tile_rects, thres=0.2, iou_kernel='clipper'):
+    '''
+    stitch the merged quadrangles of overlapping tiles of one image; only
+    quadrangles reaching into another tile are compared, and only against
+    those of other tiles
+    :param polys_list: list of n*9 quadrangles, one per tile, already
+        shifted to image coordinates
+    :param tile_rects: t*4 tile areas (x0, y0, x1, y1) in image coordinates
+    :return: n*9 quadrangles of the whole image, in tile order
+    '''
+    from .adaptor import stitch_tiles as stitch_impl, IoUKernel
+    ps = [np.asarray(polys, dtype='float32').reshape((-1, 9)) for polys in polys_list]
+    rects = np.asarray(tile_rects, dtype='float32').reshape((-1, 4))
+    return stitch_impl(ps, rects, thres, getattr(IoUKernel, iou_kernel))
+
+
+def merge_rbox_maps(score_map, geo_map, score_thresh=0.8, thres=0.2, scale=4,
+                    precision=10000, iou_kernel='clipper', nms_mode='sequential',
+                    num_threads=0, parallel_locality=False, locality_2d=False,
+                    max_output=0, min_score=float('-inf'), workspace=None, stats=None):
+    '''
+    threshold an EAST score map, restore the RBOX quadrangles and merge
+    them, all in one native pass
+    :param score_map: h*w score map
+    :param geo_map: h*w*5 RBOX geometry map
+    :param scale: input image pixels per score map pixel
+    :param precision: unused, as in merge_quadrangle_n9
+    :param parallel_locality: decode and merge stripes of score map rows on
+        several threads, with the same result as the serial pass
+    :param locality_2d, max_output, min_score, workspace, stats: see
+        merge_quadrangle_n9; the input count is that of the pixels above
+        score_thresh
+    :return: n*9 merged quadrangles, as merge_quadrangle_n9
+    '''
+    from .adaptor import merge_rbox_maps as decode_impl, IoUKernel, NmsMode
+    if workspace is not None:
+        decode_impl = workspace.merge_rbox_maps
+    return decode_impl(score_map, geo_map, score_thresh, thres, scale,
+                       getattr(IoUKernel, iou_kernel), getattr(NmsMode, nms_mode),
+                       num_threads, parallel_locality, locality_2d, max_output, min_score, stats)
+
+
+def restore_rbox_maps(score_map, geo_map, score_thresh=0.8, scale=4):
+    '''
+    the candidates merge_rbox_maps merges, before any NMS
+    :return: n*9 quadrangles of the score map pixels above score_thresh, in
+        row-major order
+    '''
+    from .adaptor import restore_rbox_maps as restore_impl
+    return restore_impl(score_map, geo_map, score_thresh, scale)
+
+
+class IncrementalNMS(object):
+    '''
+    merge_quadrangle_n9 over a stream of batches in y order, e.g. row bands
+    of a long document, emitting the quadrangles no later input can affect
+    as soon as possible. All emitted quadrangles together are the result of
+    merge_quadrangle_n9 on the whole input.
+    '''
+
+    def __init__(self, thres=0.3, iou_kernel='clipper', min_score=float('-inf')):
+        from .adaptor import IncrementalNMS as impl, IoUKernel
+        self._impl = impl(thres, getattr(IoUKernel, iou_kernel), min_score)
+
+    def push(self, polys, frontier=float('-inf')):
+        '''
+        :param polys: n*9 quadrangles, continuing the y order of the previous
+            batches
+        :param frontier: no later quadrangle reaches above this y; nothing
+            becomes final before a frontier is given
+        :return: k*9 quadrangles that became final
+        '''
+        return self._impl.push(np.asarray(polys, dtype='float32').reshape((-1, 9)), frontier)
+
+    def push_rbox_rows(self, score_map, geo_map, row0, score_thresh=0.8, scale=4,
+                       frontier=float('-inf')):
+        '''
+        decode rows [row0, row0 + h) of an EAST score map, as merge_rbox_maps
+        does, and push the quadrangles
+        :param score_map: h*w score map rows
+        :param geo_map: the matching h*w*5 geometry map rows
+        '''
+        return self._impl.push_rbox_rows(score_map, geo_map, row0, score_thresh, scale, frontier)
+
+    def finish(self):
+        '''
+        :return: k*9 quadrangles not emitted yet
+        '''
+        return self._impl.finish()
+
+
+class TemporalNMS(object):
+    '''
+    merge_quadrangle_n9 for the frames of a video: candidates matching the
+    text tracked in the previous frames skip the NMS and refine their track,
+    only the rest goes through it and starts new tracks
+    '''
+
+    def __init__(self, thres=0.3, match_thres=0.5, smoothing=0.5, max_missed=0,
+                 iou_kernel='clipper', min_score=float('-inf'), max_output=0):
+        '''
+        :param match_thres: a candidate continues a track if the IoU of their
+            bounding boxes is above this
+        :param smoothing: weight of the previous geometry and score in the
+            moving average of a track; 0 disables the smoothing
+        :param max_missed: frames a track survives without a match
+        :param max_output: return at most this many tracks per frame, the
+            highest scoring first; 0 for all
+        '''
+        from .adaptor import TemporalNMS as impl, IoUKernel
+        self._impl = impl(thres, match_thres, smoothing, max_missed,
+                          getattr(IoUKernel, iou_kernel), min_score, max_output)
+
+    def update(self, polys):
+        '''
+        :param polys: n*9 quadrangles of the next frame, y-sorted
+        :return: k*9 smoothed quadrangles of the tracks seen in this frame,
+            and their k track ids
+        '''
+        return self._impl.update(np.asarray(polys, dtype='float32').reshape((-1, 9)))
+
+    def reset(self):
+        self._impl.reset()
+
+
+def merge_rbox_n6(rboxes, thres=0.3):
+    '''
+    merge_quadrangle_n9 for rotated rectangles, with an analytic IoU and
+    merging done on the rectangle parameters
+    :param rboxes: n*6 rectangles (cx, cy, w, h, angle, score), y-sorted;
+        the angle follows the RBOX geometry map
+    :return: n*6 merged rectangles
+    '''
+    from .adaptor import merge_rbox_n6 as nms_impl
+    if len(rboxes) == 0:
+        return np.zeros((0, 6), dtype='float32')
+    return nms_impl(rboxes, thres)
+
+
+def merge_rbox_maps_n6(score_map, geo_map, score_thresh=0.8, thres=0.2, scale=4):
+    '''
+    merge_rbox_maps, keeping the boxes as rotated rectangles throughout
+    :return: n*6 merged rectangles, as merge_rbox_n6
+    '''
+    from .adaptor import merge_rbox_maps_n6 as decode_impl
+    return decode_impl(score_map, geo_map, score_thresh, thres, scale)
+
+
+def rbox_n6_to_quadrangle_n9(rboxes):
+    '''
+    corners of rotated rectangles, in the vertex order of
+    icdar.restore_rectangle_rbox
+    :param rboxes: n*6 rectangles, as returned by merge_rbox_n6
+    :return: n*9 quadrangles and scores
+    '''
+    r = np.asarray(rboxes, dtype='float32').reshape((-1, 6))
+    c, s = np.cos(r[:, 4:5]), np.sin(r[:, 4:5])
+    dx = np.array([[-0.5, 0.5, 0.5, -0.5]], dtype='float32') * r[:, 2:3]
+    dy = np.array([[-0.5, -0.5, 0.5, 0.5]], dtype='float32') * r[:, 3:4]
+    quads = np.empty((len(r), 9), dtype='float32')
+    quads[:, 0:8:2] = c * dx + s * dy + r[:, 0:1]
+    quads[:, 1:8:2] = -s * dx + c * dy + r[:, 1:2]
+    quads[:, 8] = r[:, 5]
+    return quads
+
+
+def rescore_quadrangle_n9(polys, score_map, scale=4, num_threads=0):
+    '''
+    replace the score of each quadrangle by the mean of score_map inside it,
+    as cv2.fillPoly + cv2.mean on a full-size mask would; the few crossing
+    the border of the map are scored with exactly those, as their clipping
+    depends on the OpenCV version
+    :param polys: n*9 quadrangles in input image coordinates
+    :param scale: input image pixels per score map pixel
+    :param num_threads: worker threads, 0 for one per core
+    :return: the rescored quadrangles (polys itself if it was writeable,
+        C-contiguous float32)
+    '''
+    from .adaptor import rescore_quadrangle_n9 as rescore_impl
+    polys = np.require(polys, dtype='float32', requirements=['C_CONTIGUOUS', 'WRITEABLE'])
+    if len(polys) == 0:
+        return polys
+    border = rescore_impl(polys, score_map, scale, num_threads)
+    if border:
+        import cv2
+        for i in border:
+            mask = np.zeros_like(score_map, dtype=np.uint8)
+            cv2.fillPoly(mask, polys[i, :8].reshape((-1, 4, 2)).astype(np.int32) // scale, 1)
+            polys[i, 8] = cv2.mean(score_map, mask)[0]
+    return polys
+
+
+class RecordWriter(object):
+    '''
+    append the post-processing inputs of frames to a record file, to replay
+    them offline with lanms/replay or lanms/bench; the layout is described
+    in lanms/record.h. Safe to share between threads
+    '''
+    MAGIC = b'LNMSREC1'
+
+    def __init__(self, path):
+        self._lock = threading.Lock()
+        self._f = open(path, 'ab')
+        if self._f.tell() == 0:
+            self._f.write(self.MAGIC)
+
+    def write(self, score_map, geo_map, boxes, score_map_thresh, nms_thres, box_thresh, scale=4):
+        '''
+        :param score_map: h*w score map
+        :param geo_map: h*w*5 RBOX geometry map
+        :param boxes: n*9 pre-NMS boxes, as restore_rbox_maps returns
+        :param score_map_thresh, nms_thres, box_thresh: the thresholds the
+            frame was processed with
+        '''
+        score_map = np.ascontiguousarray(score_map, dtype='<f4')
+        geo_map = np.ascontiguousarray(geo_map, dtype='<f4')
+        boxes = np.ascontiguousarray(boxes, dtype='<f4').reshape((-1, 9))
+        h, w = score_map.shape
+        header = struct.pack('<3I4f', h, w, len(boxes), scale, score_map_thresh, nms_thres, box_thresh)
+        with self._lock:
+            self._f.write(header)
+            self._f.write(score_map.tobytes())
+            self._f.write(geo_map.tobytes())
+            self._f.write(boxes.tobytes())
+            self._f.flush()
+
+    def close(self):
+        with self._lock:
+            self._f.close()
+
+
+def read_records(path):
+    '''
+    iterate over the frames of a record file written by RecordWriter; a
+    frame cut short at the end is dropped
+    :return: dicts of score_map, geo_map, boxes, score_map_thresh,
+        nms_thres, box_thresh and scale
+    '''
+    header = struct.Struct('<3I4f')
+    with open(path, 'rb') as f:
+        if f.read(len(RecordWriter.MAGIC)) != RecordWriter.MAGIC:
+            raise ValueError('not a record file: {}'.format(path))
+        while True:
+            hd = f.read(header.size)
+            if len(hd) < header.size:
+                return
+            h, w, n, scale, score_map_thresh, nms_thres, box_thresh = header.unpack(hd)
+            sizes = (h * w, h * w * 5, n * 9)
+            data = f.read(sum(sizes) * 4)
+            if len(data) < sum(sizes) * 4:
+                return
+            arr = np.frombuffer(data, dtype='<f4')
+            yield dict(score_map=arr[:sizes[0]].reshape((h, w)),
+                       geo_map=arr[sizes[0]:sizes[0] + sizes[1]].reshape((h, w, 5)),
+                       boxes=arr[sizes[0] + sizes[1]:].reshape((n, 9)),
+                       score_map_thresh=score_map_thresh, nms_thres=nms_thres,
+                       box_thresh=box_thresh, scale=scale)
+
+
+def synthetic_workload(name, n, seed=0):
+    '''
+    a synthetic EAST-like candidate cloud, generated natively by the same
+    code as the clouds of lanms/bench
+    :param name: one of WORKLOADS
+    :return: n*9 quadrangles and scores, y-sorted
+    '''
+    from .adaptor import synthetic_workload as workload_impl
+    return workload_impl(name, n, seed)
+
+
+def trace_enable(capacity=1 << 16):
+    '''
+    record the spans of the native code and of trace_span blocks into a
+    process-wide ring buffer that keeps the latest `capacity` of them; the
+    capacity is fixed by the first call
+    '''
+    global _tracing
+    from .adaptor import trace_enable as enable_impl
+    enable_impl(capacity)
+    _tracing = True
+
+
+def trace_disable():
+    global _tracing
+    from .adaptor import trace_disable as disable_impl
+    disable_impl()
+    _tracing = False
+
+
+class trace_span(object):
+    '''
+    record a block as a span of the calling thread on the trace timeline,
+    e.g. `with lanms.trace_span('net'): ...`; next to free while tracing
+    is off
+    '''
+    __slots__ = ('name', 'begin')
+
+    def __init__(self, name):
+        self.name = name
+        self.begin = None
+
+    def __enter__(self):
+        if _tracing:
+            self.begin = trace_now()
+        return self
+
+    def __exit__(self, *exc):
+        if self.begin is not None:
+            _trace_record(self.name, self.begin, trace_now())
+
+
+def trace_dump(path=None, since=0):
+    '''
+    :param path: also write the trace to this file
+    :param since: only spans ending at or after this trace_now() time
+    :return: the buffered spans as Chrome trace-event JSON, for
+        chrome://tracing or Perfetto
+    '''
+    from .adaptor import trace_dump as dump_impl
+    json = dump_impl(since)
+    if path is not None:
+        with open(path, 'w') as f:
+            f.write(json)
+    return json
@@ -4,57 +4,941 @@
 #include "pybind11/stl_bind.h"
 
 #include "lanms.h"
+#include "workload.h"
+
+#include <memory>
+#include <mutex>
+#include <unordered_set>
 
 namespace py = pybind11;
 
 
 namespace lanms_adaptor {
 
-	std::vector<std::vector<float>> polys2floats(const std::vector<lanms::Polygon> &polys) {
-		std::vector<std::vector<float>> ret;
-		for (size_t i = 0; i < polys.size(); i ++) {
+	/**
+	 * Write polygons straight into a new contiguous k-by-9 float array.
+	 */
+	void write_polys(const std::vector<lanms::Polygon> &polys, float *out) {
+		for (size_t i = 0; i < polys.size(); i ++, out += 9) {
 			auto &p = polys[i];
 			auto &poly = p.poly;
-			ret.emplace_back(std::vector<float>{
-					float(poly[0].X), float(poly[0].Y),
-					float(poly[1].X), float(poly[1].Y),
-					float(poly[2].X), float(poly[2].Y),
-					float(poly[3].X), float(poly[3].Y),
-					float(p.score),
-					});
+			for (size_t j = 0; j < 4; j ++) {
+				out[j * 2] = poly.x[j];
+				out[j * 2 + 1] = poly.y[j];
+			}
+			out[8] = float(p.score);
 		}
+	}
 
+	py::array_t<float> polys2array(const std::vector<lanms::Polygon> &polys) {
+		py::array_t<float> ret({polys.size(), size_t(9)});
+		write_polys(polys, ret.mutable_data());
 		return ret;
 	}
 
 
+	/**
+	 * Lock `mutex` with the GIL released, so a thread waiting for it never
+	 * holds the GIL its owner needs to finish. The lock may then be kept
+	 * while the GIL is released and acquired again.
+	 */
+	std::unique_lock<std::mutex> lock_nogil(std::mutex &mutex) {
+		py::gil_scoped_release release;
+		return std::unique_lock<std::mutex>(mutex);
+	}
+
+
+	typedef std::shared_ptr<std::vector<float>> OutBuffer;
+
+	/**
+	 * lanms::Workspace plus a grow-only buffer for the k-by-9 output, so
+	 * that a steady stream of calls allocates no output memory either.
+	 * Calls run with the GIL released, so they hold `mutex` to keep
+	 * Python threads sharing the workspace from running at once.
+	 */
+	struct Workspace: lanms::Workspace {
+		Workspace(): out_n9(std::make_shared<std::vector<float>>()) {}
+
+		OutBuffer out_n9;
+		std::mutex mutex;
+	};
+
+	/**
+	 * Like polys2array, but the array is backed by the output buffer of
+	 * `ws`, shared with the array through a capsule. The buffer is reused
+	 * only once no array refers to it any more, so a kept result stays
+	 * valid and the next call takes a fresh buffer instead.
+	 */
+	py::array_t<float> polys2view(Workspace &ws, const std::vector<lanms::Polygon> &polys) {
+		if (ws.out_n9.use_count() > 1)
+			ws.out_n9 = std::make_shared<std::vector<float>>();
+		auto &buf = *ws.out_n9;
+		buf.resize(polys.size() * 9);
+		write_polys(polys, buf.data());
+		py::capsule owner(new OutBuffer(ws.out_n9), [](void *p) { delete static_cast<OutBuffer *>(p); });
+		return py::array_t<float>({polys.size(), size_t(9)}, buf.data(), owner);
+	}
+
+
+	/**
+	 * Counters of a Python call: collected only if the caller passed a
+	 * dict as `stats`, which then receives them.
+	 */
+	struct StatsOut {
+		StatsOut(py::object dict): dict(dict) {}
+
+		lanms::NmsStats *get() {
+			return dict.is_none() ? nullptr : &stats;
+		}
+
+		void write() {
+			if (dict.is_none())
+				return;
+			auto d = dict.cast<py::dict>();
+			d["input"] = stats.input;
+			d["after_locality"] = stats.after_locality;
+			d["merges"] = stats.merges;
+			d["iou_evals"] = stats.iou_evals;
+			d["aabb_rejects"] = stats.aabb_rejects;
+			d["kept"] = stats.kept;
+			d["locality_ns"] = stats.locality_ns;
+			d["nms_setup_ns"] = stats.nms_setup_ns;
+			d["nms_suppress_ns"] = stats.nms_suppress_ns;
+		}
+
+		py::object dict;
+		lanms::NmsStats stats;
+	};
+
+
 	/**
 	 *
 	 * \param quad_n9 an n-by-9 numpy array, where first 8 numbers denote the
 	 *		quadrangle, and the last one is the score
 	 * \param iou_threshold two quadrangles with iou score above this threshold
 	 *		will be merged
+	 * \param iou_kernel the IoU implementation to use
+	 * \param nms_mode the suppression algorithm of the final NMS pass
+	 * \param num_threads worker threads of the parallel passes; 0 uses every core
+	 * \param parallel_locality run the first, locality-aware pass in stripes
+	 * \param locality_2d let the first pass also merge into groups of the
+	 *		rows above; overrides parallel_locality
+	 * \param max_output stop after this many quadrangles; 0 keeps all
+	 * \param min_score merged quadrangles scoring below this are dropped
+	 *		before the final NMS; a merged score is the sum of the scores
+	 *		of the merged quadrangles
+	 * \param stats counters to add the call to, or nullptr
 	 *
-	 * \return an n-by-9 numpy array, the merged quadrangles
+	 * \return the merged quadrangles, in ws.out
 	 */
-	std::vector<std::vector<float>> merge_quadrangle_n9(
+	const std::vector<lanms::Polygon> &merge_quadrangle_n9(
+			lanms::Workspace &ws,
 			py::array_t<float, py::array::c_style | py::array::forcecast> quad_n9,
-			float iou_threshold) {
+			float iou_threshold,
+			lanms::IoUKernel iou_kernel,
+			lanms::NmsMode nms_mode,
+			size_t num_threads,
+			bool parallel_locality,
+			bool locality_2d,
+			size_t max_output,
+			float min_score,
+			lanms::NmsStats *stats) {
 		auto pbuf = quad_n9.request();
 		if (pbuf.ndim != 2 || pbuf.shape[1] != 9)
 			throw std::runtime_error("quadrangles must have a shape of (n, 9)");
 		auto n = pbuf.shape[0];
 		auto ptr = static_cast<float *>(pbuf.ptr);
-		return polys2floats(lanms::merge_quadrangle_n9(ptr, n, iou_threshold));
+		lanms::NmsOptions opts(iou_kernel, nms_mode, num_threads);
+		opts.parallel_locality = parallel_locality;
+		opts.locality_2d = locality_2d;
+		opts.max_output = max_output;
+		opts.min_score = min_score;
+		opts.stats = stats;
+		py::gil_scoped_release release;
+		return lanms::merge_quadrangle_n9(ptr, n, iou_threshold, opts, ws);
+	}
+
+	py::array_t<float> merge_quadrangle_n9(
+			py::array_t<float, py::array::c_style | py::array::forcecast> quad_n9,
+			float iou_threshold,
+			lanms::IoUKernel iou_kernel,
+			lanms::NmsMode nms_mode,
+			size_t num_threads,
+			bool parallel_locality,
+			bool locality_2d,
+			size_t max_output,
+			float min_score,
+			py::object stats) {
+		lanms::Workspace ws;
+		StatsOut out(stats);
+		auto ret = polys2array(merge_quadrangle_n9(ws, quad_n9, iou_threshold, iou_kernel, nms_mode,
+					num_threads, parallel_locality, locality_2d, max_output, min_score, out.get()));
+		out.write();
+		return ret;
+	}
+
+	/**
+	 * merge_quadrangle_n9 on the buffers of a Workspace; returns an array
+	 * backed by its output buffer, see polys2view.
+	 */
+	py::array_t<float> workspace_merge_quadrangle_n9(
+			Workspace &ws,
+			py::array_t<float, py::array::c_style | py::array::forcecast> quad_n9,
+			float iou_threshold,
+			lanms::IoUKernel iou_kernel,
+			lanms::NmsMode nms_mode,
+			size_t num_threads,
+			bool parallel_locality,
+			bool locality_2d,
+			size_t max_output,
+			float min_score,
+			py::object stats) {
+		auto lock = lock_nogil(ws.mutex);
+		StatsOut out(stats);
+		auto ret = polys2view(ws, merge_quadrangle_n9(ws, quad_n9, iou_threshold, iou_kernel, nms_mode,
+					num_threads, parallel_locality, locality_2d, max_output, min_score, out.get()));
+		out.write();
+		return ret;
+	}
+
+
+	template<typename Suppression>
+	Suppression make_suppression(float) {
+		return Suppression();
+	}
+
+	template<>
+	lanms::GaussianSuppression make_suppression<lanms::GaussianSuppression>(float sigma) {
+		return lanms::GaussianSuppression(sigma);
+	}
+
+
+	/**
+	 * merge_quadrangle_n9 compiled for one combination of IoU, merge and
+	 * suppression policies.
+	 *
+	 * \param sigma spread of the Gaussian suppression; unused by the others
+	 * \param min_score floor of the final NMS; soft suppression also drops
+	 *		quadrangles decayed below it and stops once none reaches it
+	 */
+	template<typename IoU, typename Merge, typename Suppression>
+	py::array_t<float> merge_quadrangle_n9_policy(
+			py::array_t<float, py::array::c_style | py::array::forcecast> quad_n9,
+			float iou_threshold,
+			float sigma,
+			lanms::NmsMode nms_mode,
+			size_t num_threads,
+			bool parallel_locality,
+			bool locality_2d,
+			size_t max_output,
+			float min_score) {
+		auto pbuf = quad_n9.request();
+		if (pbuf.ndim != 2 || pbuf.shape[1] != 9)
+			throw std::runtime_error("quadrangles must have a shape of (n, 9)");
+		auto n = pbuf.shape[0];
+		auto ptr = static_cast<float *>(pbuf.ptr);
+		lanms::NmsOptions opts(lanms::IOU_CLIPPER, nms_mode, num_threads);
+		opts.parallel_locality = parallel_locality;
+		opts.locality_2d = locality_2d;
+		opts.max_output = max_output;
+		opts.min_score = min_score;
+		std::vector<lanms::Polygon> polys;
+		{
+			py::gil_scoped_release release;
+			polys = lanms::merge_quadrangle_n9<IoU, Merge>(ptr, n, iou_threshold,
+					make_suppression<Suppression>(sigma), opts);
+		}
+		return polys2array(polys);
+	}
+
+	template<typename IoU, typename Merge, typename Suppression>
+	void def_policy(py::module &m, const std::string &name) {
+		m.def(name.c_str(), &merge_quadrangle_n9_policy<IoU, Merge, Suppression>,
+				"merge quadrangles with fixed IoU, merge and suppression policies",
+				py::arg("quad_n9"), py::arg("iou_threshold"), py::arg("sigma") = 0.5f,
+				py::arg("nms_mode") = lanms::NMS_SEQUENTIAL, py::arg("num_threads") = 0,
+				py::arg("parallel_locality") = false, py::arg("locality_2d") = false,
+				py::arg("max_output") = 0,
+				py::arg("min_score") = -std::numeric_limits<float>::infinity());
+	}
+
+	template<typename IoU, typename Merge>
+	void def_suppression_policies(py::module &m, const std::string &name) {
+		def_policy<IoU, Merge, lanms::HardSuppression>(m, name + "_hard");
+		def_policy<IoU, Merge, lanms::LinearSuppression>(m, name + "_linear");
+		def_policy<IoU, Merge, lanms::GaussianSuppression>(m, name + "_gaussian");
+	}
+
+	/**
+	 * Register merge_quadrangle_n9_<iou>_<merge>_<suppression> for every
+	 * merge and suppression policy.
+	 */
+	template<typename IoU>
+	void def_policies(py::module &m, const std::string &name) {
+		def_suppression_policies<IoU, lanms::WeightedMerge>(m, name + "_weighted");
+		def_suppression_policies<IoU, lanms::MaxScoreMerge>(m, name + "_max_score");
+		def_suppression_policies<IoU, lanms::KeepBestMerge>(m, name + "_keep_best");
+	}
+
+
+	/**
+	 *
+	 * \param quad_n9_list a list of n-by-9 numpy arrays, one per image
+	 * \param iou_threshold two quadrangles with iou score above this threshold
+	 *		will be merged
+	 * \param iou_kernel the IoU implementation to use
+	 * \param nms_mode the suppression algorithm of the final NMS pass
+	 * \param num_threads worker threads; 0 uses every core
+	 *
+	 * \return a list of n-by-9 numpy arrays, the merged quadrangles
+	 */
+	std::vector<py::array_t<float>> merge_quadrangle_n9_batch(
+			std::vector<py::array_t<float, py::array::c_style | py::array::forcecast>> quad_n9_list,
+			float iou_threshold,
+			lanms::IoUKernel iou_kernel,
+			lanms::NmsMode nms_mode,
+			size_t num_threads) {
+		std::vector<const float *> data;
+		std::vector<size_t> n;
+		for (auto &&quad_n9: quad_n9_list) {
+			auto pbuf = quad_n9.request();
+			if (pbuf.ndim != 2 || pbuf.shape[1] != 9)
+				throw std::runtime_error("quadrangles must have a shape of (n, 9)");
+			data.emplace_back(static_cast<float *>(pbuf.ptr));
+			n.emplace_back(pbuf.shape[0]);
+		}
+
+		std::vector<std::vector<lanms::Polygon>> polys;
+		{
+			py::gil_scoped_release release;
+			polys = lanms::merge_quadrangle_n9_batch(data, n, iou_threshold,
+					lanms::NmsOptions(iou_kernel, nms_mode, num_threads), num_threads);
+		}
+
+		std::vector<py::array_t<float>> ret;
+		for (auto &&p: polys)
+			ret.emplace_back(polys2array(p));
+		return ret;
+	}
+
+
+	/**
+	 *
+	 * \param quad_n9_list a list of n-by-9 numpy arrays, the merged
+	 *		quadrangles of each tile in image coordinates
+	 * \param tile_rects a t-by-4 numpy array of tile areas (x0, y0, x1, y1)
+	 * \param iou_threshold quadrangles of different tiles with iou score
+	 *		above this threshold are duplicates
+	 * \param iou_kernel the IoU implementation to use
+	 *
+	 * \return an n-by-9 numpy array, the quadrangles of the whole image
+	 */
+	py::array_t<float> stitch_tiles(
+			std::vector<py::array_t<float, py::array::c_style | py::array::forcecast>> quad_n9_list,
+			py::array_t<float, py::array::c_style | py::array::forcecast> tile_rects,
+			float iou_threshold,
+			lanms::IoUKernel iou_kernel) {
+		auto rbuf = tile_rects.request();
+		if (rbuf.ndim != 2 || rbuf.shape[1] != 4 || size_t(rbuf.shape[0]) != quad_n9_list.size())
+			throw std::runtime_error("tile rects must have a shape of (t, 4), one row per tile");
+		std::vector<const float *> data;
+		std::vector<size_t> n;
+		for (auto &&quad_n9: quad_n9_list) {
+			auto pbuf = quad_n9.request();
+			if (pbuf.ndim != 2 || pbuf.shape[1] != 9)
+				throw std::runtime_error("quadrangles must have a shape of (n, 9)");
+			data.emplace_back(static_cast<float *>(pbuf.ptr));
+			n.emplace_back(pbuf.shape[0]);
+		}
+
+		std::vector<lanms::Polygon> polys;
+		{
+			py::gil_scoped_release release;
+			polys = lanms::stitch_tiles(data, n, static_cast<float *>(rbuf.ptr), iou_threshold, iou_kernel);
+		}
+		return polys2array(polys);
+	}
+
+
+	/**
+	 *
+	 * \param score_map an h-by-w numpy array of text scores
+	 * \param geo_map an h-by-w-by-5 numpy array of RBOX geometry
+	 * \param score_threshold locations scoring above this become candidates
+	 * \param iou_threshold two quadrangles with iou score above this threshold
+	 *		will be merged
+	 * \param scale input image pixels per score map pixel
+	 * \param iou_kernel the IoU implementation to use
+	 * \param nms_mode the suppression algorithm of the final NMS pass
+	 * \param num_threads worker threads of the parallel passes; 0 uses every core
+	 * \param parallel_locality decode and run the locality-aware pass in
+	 *		stripes of score map rows
+	 * \param locality_2d let the first pass also merge into groups of the
+	 *		rows above; overrides parallel_locality
+	 * \param max_output stop after this many quadrangles; 0 keeps all
+	 * \param min_score merged quadrangles scoring below this are dropped
+	 *		before the final NMS; a merged score is the sum of the scores
+	 *		of the merged quadrangles
+	 * \param stats counters to add the call to, or nullptr
+	 *
+	 * \return the merged quadrangles, in ws.out
+	 */
+	const std::vector<lanms::Polygon> &merge_rbox_maps(
+			lanms::Workspace &ws,
+			py::array_t<float, py::array::c_style | py::array::forcecast> score_map,
+			py::array_t<float, py::array::c_style | py::array::forcecast> geo_map,
+			float score_threshold,
+			float iou_threshold,
+			float scale,
+			lanms::IoUKernel iou_kernel,
+			lanms::NmsMode nms_mode,
+			size_t num_threads,
+			bool parallel_locality,
+			bool locality_2d,
+			size_t max_output,
+			float min_score,
+			lanms::NmsStats *stats) {
+		auto sbuf = score_map.request(), gbuf = geo_map.request();
+		if (sbuf.ndim != 2)
+			throw std::runtime_error("score map must have a shape of (h, w)");
+		if (gbuf.ndim != 3 || gbuf.shape[0] != sbuf.shape[0] || gbuf.shape[1] != sbuf.shape[1] || gbuf.shape[2] != 5)
+			throw std::runtime_error("geo map must have a shape of (h, w, 5)");
+		lanms::NmsOptions opts(iou_kernel, nms_mode, num_threads);
+		opts.parallel_locality = parallel_locality;
+		opts.locality_2d = locality_2d;
+		opts.max_output = max_output;
+		opts.min_score = min_score;
+		opts.stats = stats;
+		py::gil_scoped_release release;
+		return lanms::merge_rbox_maps(
+				static_cast<float *>(sbuf.ptr), static_cast<float *>(gbuf.ptr),
+				sbuf.shape[0], sbuf.shape[1],
+				score_threshold, iou_threshold, scale, opts, ws);
+	}
+
+	py::array_t<float> merge_rbox_maps(
+			py::array_t<float, py::array::c_style | py::array::forcecast> score_map,
+			py::array_t<float, py::array::c_style | py::array::forcecast> geo_map,
+			float score_threshold,
+			float iou_threshold,
+			float scale,
+			lanms::IoUKernel iou_kernel,
+			lanms::NmsMode nms_mode,
+			size_t num_threads,
+			bool parallel_locality,
+			bool locality_2d,
+			size_t max_output,
+			float min_score,
+			py::object stats) {
+		lanms::Workspace ws;
+		StatsOut out(stats);
+		auto ret = polys2array(merge_rbox_maps(ws, score_map, geo_map, score_threshold, iou_threshold, scale,
+					iou_kernel, nms_mode, num_threads, parallel_locality, locality_2d, max_output, min_score,
+					out.get()));
+		out.write();
+		return ret;
+	}
+
+	/**
+	 * merge_rbox_maps on the buffers of a Workspace; returns an array
+	 * backed by its output buffer, see polys2view.
+	 */
+	py::array_t<float> workspace_merge_rbox_maps(
+			Workspace &ws,
+			py::array_t<float, py::array::c_style | py::array::forcecast> score_map,
+			py::array_t<float, py::array::c_style | py::array::forcecast> geo_map,
+			float score_threshold,
+			float iou_threshold,
+			float scale,
+			lanms::IoUKernel iou_kernel,
+			lanms::NmsMode nms_mode,
+			size_t num_threads,
+			bool parallel_locality,
+			bool locality_2d,
+			size_t max_output,
+			float min_score,
+			py::object stats) {
+		auto lock = lock_nogil(ws.mutex);
+		StatsOut out(stats);
+		auto ret = polys2view(ws, merge_rbox_maps(ws, score_map, geo_map, score_threshold, iou_threshold, scale,
+					iou_kernel, nms_mode, num_threads, parallel_locality, locality_2d, max_output, min_score,
+					out.get()));
+		out.write();
+		return ret;
+	}
+
+	/**
+	 *
+	 * \param score_map an h-by-w score map
+	 * \param geo_map an h-by-w-by-5 RBOX geometry map
+	 *
+	 * \return the n-by-9 candidates merge_rbox_maps would merge, in
+	 *		row-major order
+	 */
+	py::array_t<float> restore_rbox_maps(
+			py::array_t<float, py::array::c_style | py::array::forcecast> score_map,
+			py::array_t<float, py::array::c_style | py::array::forcecast> geo_map,
+			float score_threshold,
+			float scale) {
+		auto sbuf = score_map.request(), gbuf = geo_map.request();
+		if (sbuf.ndim != 2)
+			throw std::runtime_error("score map must have a shape of (h, w)");
+		if (gbuf.ndim != 3 || gbuf.shape[0] != sbuf.shape[0] || gbuf.shape[1] != sbuf.shape[1] || gbuf.shape[2] != 5)
+			throw std::runtime_error("geo map must have a shape of (h, w, 5)");
+		std::vector<float> boxes;
+		{
+			py::gil_scoped_release release;
+			lanms::restore_rbox_maps(
+					static_cast<float *>(sbuf.ptr), static_cast<float *>(gbuf.ptr),
+					sbuf.shape[0], sbuf.shape[1], score_threshold, scale, boxes);
+		}
+		py::array_t<float> ret({boxes.size() / 9, size_t(9)});
+		std::copy(boxes.begin(), boxes.end(), ret.mutable_data());
+		return ret;
+	}
+
+	py::array_t<float> rboxes2array(const std::vector<lanms::RBox> &boxes) {
+		py::array_t<float> ret({boxes.size(), size_t(6)});
+		auto out = ret.mutable_data();
+		for (size_t i = 0; i < boxes.size(); i ++, out += 6) {
+			auto &b = boxes[i];
+			out[0] = b.cx;
+			out[1] = b.cy;
+			out[2] = b.w;
+			out[3] = b.h;
+			out[4] = b.angle;
+			out[5] = b.score;
+		}
+		return ret;
+	}
+
+
+	/**
+	 * lanms::IncrementalNMS with the options Python can set. Calls hold
+	 * `mutex`, as Workspace calls do.
+	 */
+	struct IncrementalNMS: lanms::IncrementalNMS {
+		IncrementalNMS(float iou_threshold, lanms::IoUKernel iou_kernel, float min_score):
+			lanms::IncrementalNMS(iou_threshold, options(iou_kernel, min_score)) {}
+
+		static lanms::NmsOptions options(lanms::IoUKernel iou_kernel, float min_score) {
+			lanms::NmsOptions opts(iou_kernel);
+			opts.min_score = min_score;
+			return opts;
+		}
+
+		std::mutex mutex;
+	};
+
+	/**
+	 *
+	 * \param quad_n9 the next n-by-9 quadrangles, continuing the y order
+	 * \param frontier no later quadrangle reaches above this y
+	 *
+	 * \return a k-by-9 numpy array, the quadrangles that became final
+	 */
+	py::array_t<float> incremental_push(
+			IncrementalNMS &nms,
+			py::array_t<float, py::array::c_style | py::array::forcecast> quad_n9,
+			float frontier) {
+		auto pbuf = quad_n9.request();
+		if (pbuf.ndim != 2 || pbuf.shape[1] != 9)
+			throw std::runtime_error("quadrangles must have a shape of (n, 9)");
+		auto lock = lock_nogil(nms.mutex);
+		std::vector<lanms::Polygon> *polys;
+		{
+			py::gil_scoped_release release;
+			polys = &nms.push(static_cast<float *>(pbuf.ptr), pbuf.shape[0], frontier);
+		}
+		return polys2array(*polys);
+	}
+
+	/**
+	 *
+	 * \param score_map an h-by-w numpy array, rows [row0, row0 + h) of the
+	 *		score map
+	 * \param geo_map the matching h-by-w-by-5 rows of the geometry map
+	 */
+	py::array_t<float> incremental_push_rbox_rows(
+			IncrementalNMS &nms,
+			py::array_t<float, py::array::c_style | py::array::forcecast> score_map,
+			py::array_t<float, py::array::c_style | py::array::forcecast> geo_map,
+			size_t row0,
+			float score_threshold,
+			float scale,
+			float frontier) {
+		auto sbuf = score_map.request(), gbuf = geo_map.request();
+		if (sbuf.ndim != 2)
+			throw std::runtime_error("score map must have a shape of (h, w)");
+		if (gbuf.ndim != 3 || gbuf.shape[0] != sbuf.shape[0] || gbuf.shape[1] != sbuf.shape[1] || gbuf.shape[2] != 5)
+			throw std::runtime_error("geo map must have a shape of (h, w, 5)");
+		auto lock = lock_nogil(nms.mutex);
+		std::vector<lanms::Polygon> *polys;
+		{
+			py::gil_scoped_release release;
+			polys = &nms.push_rbox_rows(
+					static_cast<float *>(sbuf.ptr), static_cast<float *>(gbuf.ptr),
+					row0, sbuf.shape[0], sbuf.shape[1], score_threshold, scale, frontier);
+		}
+		return polys2array(*polys);
+	}
+
+	py::array_t<float> incremental_finish(IncrementalNMS &nms) {
+		auto lock = lock_nogil(nms.mutex);
+		std::vector<lanms::Polygon> *polys;
+		{
+			py::gil_scoped_release release;
+			polys = &nms.finish();
+		}
+		return polys2array(*polys);
+	}
+
+
+	/**
+	 * lanms::TemporalNMS with the options Python can set. Calls hold
+	 * `mutex`, as Workspace calls do.
+	 */
+	struct TemporalNMS: lanms::TemporalNMS {
+		TemporalNMS(float iou_threshold, float match_threshold, float smoothing, size_t max_missed,
+				lanms::IoUKernel iou_kernel, float min_score, size_t max_output):
+			lanms::TemporalNMS(iou_threshold, match_threshold, smoothing, max_missed,
+					options(iou_kernel, min_score, max_output)) {}
+
+		static lanms::NmsOptions options(lanms::IoUKernel iou_kernel, float min_score, size_t max_output) {
+			auto opts = IncrementalNMS::options(iou_kernel, min_score);
+			opts.max_output = max_output;
+			return opts;
+		}
+
+		std::mutex mutex;
+	};
+
+	/**
+	 *
+	 * \param quad_n9 an n-by-9 numpy array, the quadrangles of the next
+	 *		frame sorted by y
+	 *
+	 * \return a k-by-9 numpy array of the smoothed quadrangles of the tracks
+	 *		seen in this frame, and a numpy array of their k ids
+	 */
+	py::tuple temporal_update(
+			TemporalNMS &nms,
+			py::array_t<float, py::array::c_style | py::array::forcecast> quad_n9) {
+		auto pbuf = quad_n9.request();
+		if (pbuf.ndim != 2 || pbuf.shape[1] != 9)
+			throw std::runtime_error("quadrangles must have a shape of (n, 9)");
+		auto lock = lock_nogil(nms.mutex);
+		std::vector<lanms::Track> *tracks;
+		{
+			py::gil_scoped_release release;
+			tracks = &nms.update(static_cast<float *>(pbuf.ptr), pbuf.shape[0]);
+		}
+
+		py::array_t<float> quads({tracks->size(), size_t(9)});
+		py::array_t<std::int64_t> ids(tracks->size());
+		auto out = quads.mutable_data();
+		auto id = ids.mutable_data();
+		for (auto &&t: *tracks) {
+			auto &poly = t.poly.poly;
+			for (size_t j = 0; j < 4; j ++) {
+				out[j * 2] = poly.x[j];
+				out[j * 2 + 1] = poly.y[j];
+			}
+			out[8] = t.poly.score;
+			out += 9;
+			*id ++ = std::int64_t(t.id);
+		}
+		return py::make_tuple(quads, ids);
+	}
+
+	void temporal_reset(TemporalNMS &nms) {
+		auto lock = lock_nogil(nms.mutex);
+		nms.reset();
+	}
+
+
+	/**
+	 *
+	 * \param rbox_n6 an n-by-6 numpy array of rotated rectangles
+	 *		(cx, cy, w, h, angle, score), sorted by y
+	 * \param iou_threshold two rectangles with iou score above this threshold
+	 *		will be merged
+	 *
+	 * \return an n-by-6 numpy array, the merged rectangles
+	 */
+	py::array_t<float> merge_rbox_n6(
+			py::array_t<float, py::array::c_style | py::array::forcecast> rbox_n6,
+			float iou_threshold) {
+		auto pbuf = rbox_n6.request();
+		if (pbuf.ndim != 2 || pbuf.shape[1] != 6)
+			throw std::runtime_error("rotated rectangles must have a shape of (n, 6)");
+		std::vector<lanms::RBox> boxes;
+		{
+			py::gil_scoped_release release;
+			boxes = lanms::merge_rbox_n6(static_cast<float *>(pbuf.ptr), pbuf.shape[0], iou_threshold);
+		}
+		return rboxes2array(boxes);
+	}
+
+
+	/**
+	 *
+	 * \param score_map an h-by-w numpy array of text scores
+	 * \param geo_map an h-by-w-by-5 numpy array of RBOX geometry
+	 * \param score_threshold locations scoring above this become candidates
+	 * \param iou_threshold two rectangles with iou score above this threshold
+	 *		will be merged
+	 * \param scale input image pixels per score map pixel
+	 *
+	 * \return an n-by-6 numpy array, the merged rectangles
+	 */
+	py::array_t<float> merge_rbox_maps_n6(
+			py::array_t<float, py::array::c_style | py::array::forcecast> score_map,
+			py::array_t<float, py::array::c_style | py::array::forcecast> geo_map,
+			float score_threshold,
+			float iou_threshold,
+			float scale) {
+		auto sbuf = score_map.request(), gbuf = geo_map.request();
+		if (sbuf.ndim != 2)
+			throw std::runtime_error("score map must have a shape of (h, w)");
+		if (gbuf.ndim != 3 || gbuf.shape[0] != sbuf.shape[0] || gbuf.shape[1] != sbuf.shape[1] || gbuf.shape[2] != 5)
+			throw std::runtime_error("geo map must have a shape of (h, w, 5)");
+		std::vector<lanms::RBox> boxes;
+		{
+			py::gil_scoped_release release;
+			boxes = lanms::merge_rbox_maps_n6(
+					static_cast<float *>(sbuf.ptr), static_cast<float *>(gbuf.ptr),
+					sbuf.shape[0], sbuf.shape[1],
+					score_threshold, iou_threshold, scale);
+		}
+		return rboxes2array(boxes);
+	}
+
+	/**
+	 *
+	 * \param quad_n9 an n-by-9 float32 numpy array, whose score column is
+	 *		overwritten in place with the mean score inside each quadrangle;
+	 *		it must be C-contiguous and writeable, as a converted copy would
+	 *		silently receive the scores instead
+	 * \param score_map an h-by-w numpy array of text scores
+	 * \param scale input image pixels per score map pixel
+	 * \param num_threads worker threads; 0 uses every core
+	 *
+	 * \return the indices of the quadrangles crossing the border of the
+	 *		score map, left unscored
+	 */
+	std::vector<size_t> rescore_quadrangle_n9(
+			py::array quad_n9,
+			py::array_t<float, py::array::c_style | py::array::forcecast> score_map,
+			int scale,
+			size_t num_threads) {
+		if (!py::isinstance<py::array_t<float>>(quad_n9))
+			throw std::runtime_error("quadrangles must be a float32 array, as they are rescored in place");
+		if (!(quad_n9.flags() & py::array::c_style) || !quad_n9.writeable())
+			throw std::runtime_error("quadrangles must be C-contiguous and writeable, as they are rescored in place");
+		auto pbuf = quad_n9.request(), sbuf = score_map.request();
+		if (pbuf.ndim != 2 || pbuf.shape[1] != 9)
+			throw std::runtime_error("quadrangles must have a shape of (n, 9)");
+		if (sbuf.ndim != 2)
+			throw std::runtime_error("score map must have a shape of (h, w)");
+		std::vector<size_t> border;
+		py::gil_scoped_release release;
+		lanms::rescore_quadrangle_n9(
+				static_cast<float *>(pbuf.ptr), pbuf.shape[0],
+				static_cast<float *>(sbuf.ptr), sbuf.shape[0], sbuf.shape[1],
+				scale, num_threads, &border);
+		return border;
+	}
+
+	/**
+	 *
+	 * \param name one of lanms::workload::NAMES
+	 *
+	 * \return the n-by-9 candidates of the synthetic workload, y-sorted
+	 */
+	py::array_t<float> synthetic_workload(const std::string &name, size_t n, unsigned seed) {
+		std::vector<float> data;
+		if (!lanms::workload::generate(name, n, seed, data))
+			throw std::runtime_error("unknown workload: " + name);
+		py::array_t<float> ret({n, size_t(9)});
+		std::copy(data.begin(), data.end(), ret.mutable_data());
+		return ret;
+	}
+
+
+	void trace_enable(size_t capacity) {
+		lanms::trace::Tracer::instance().enable(capacity);
+	}
+
+	void trace_disable() {
+		lanms::trace::Tracer::instance().disable();
+	}
+
+	/**
+	 * Record a span measured in Python on the lanms timeline. Names are
+	 * interned, as the tracer keeps only a pointer; calls hold the GIL.
+	 */
+	void trace_record(const std::string &name, std::uint64_t begin, std::uint64_t end) {
+		static std::unordered_set<std::string> names;
+		lanms::trace::Tracer::instance().record(names.insert(name).first->c_str(), begin, end);
+	}
+
+	py::str trace_dump(std::uint64_t since) {
+		std::string json;
+		{
+			py::gil_scoped_release release;
+			json = lanms::trace::Tracer::instance().dump(since);
+		}
+		return py::str(json);
 	}
 
 }
 
+
 PYBIND11_PLUGIN(adaptor) {
 	py::module m("adaptor", "NMS");
 
-	m.def("merge_quadrangle_n9", &lanms_adaptor::merge_quadrangle_n9,
-			"merge quadrangels");
+	py::enum_<lanms::IoUKernel>(m, "IoUKernel")
+		.value("clipper", lanms::IOU_CLIPPER)
+		.value("convex_quad", lanms::IOU_CONVEX_QUAD);
+
+	py::enum_<lanms::NmsMode>(m, "NmsMode")
+		.value("sequential", lanms::NMS_SEQUENTIAL)
+		.value("bitmask", lanms::NMS_BITMASK);
+
+	m.def("merge_quadrangle_n9",
+			static_cast<py::array_t<float> (*)(
+				py::array_t<float, py::array::c_style | py::array::forcecast>, float, lanms::IoUKernel,
+				lanms::NmsMode, size_t, bool, bool, size_t, float, py::object)>(&lanms_adaptor::merge_quadrangle_n9),
+			"merge quadrangels",
+			py::arg("quad_n9"), py::arg("iou_threshold"),
+			py::arg("iou_kernel") = lanms::IOU_CLIPPER,
+			py::arg("nms_mode") = lanms::NMS_SEQUENTIAL, py::arg("num_threads") = 0,
+			py::arg("parallel_locality") = false, py::arg("locality_2d") = false,
+			py::arg("max_output") = 0,
+			py::arg("min_score") = -std::numeric_limits<float>::infinity(),
+			py::arg("stats") = py::none());
+
+	lanms_adaptor::def_policies<lanms::ClipperIoU>(m, "merge_quadrangle_n9_clipper");
+	lanms_adaptor::def_policies<lanms::ConvexQuadIoU>(m, "merge_quadrangle_n9_convex_quad");
+
+	m.def("merge_quadrangle_n9_batch", &lanms_adaptor::merge_quadrangle_n9_batch,
+			"merge quadrangles of several images in parallel",
+			py::arg("quad_n9_list"), py::arg("iou_threshold"),
+			py::arg("iou_kernel") = lanms::IOU_CLIPPER,
+			py::arg("nms_mode") = lanms::NMS_SEQUENTIAL, py::arg("num_threads") = 0);
+
+	m.def("stitch_tiles", &lanms_adaptor::stitch_tiles,
+			"merge the quadrangles of overlapping tiles, deduplicating only where tiles overlap",
+			py::arg("quad_n9_list"), py::arg("tile_rects"), py::arg("iou_threshold"),
+			py::arg("iou_kernel") = lanms::IOU_CLIPPER);
+
+	m.def("merge_rbox_maps",
+			static_cast<py::array_t<float> (*)(
+				py::array_t<float, py::array::c_style | py::array::forcecast>,
+				py::array_t<float, py::array::c_style | py::array::forcecast>, float, float, float,
+				lanms::IoUKernel, lanms::NmsMode, size_t, bool, bool, size_t, float, py::object)>(&lanms_adaptor::merge_rbox_maps),
+			"decode EAST score/geometry maps and merge the quadrangles",
+			py::arg("score_map"), py::arg("geo_map"),
+			py::arg("score_threshold"), py::arg("iou_threshold"),
+			py::arg("scale"), py::arg("iou_kernel") = lanms::IOU_CLIPPER,
+			py::arg("nms_mode") = lanms::NMS_SEQUENTIAL, py::arg("num_threads") = 0,
+			py::arg("parallel_locality") = false, py::arg("locality_2d") = false,
+			py::arg("max_output") = 0,
+			py::arg("min_score") = -std::numeric_limits<float>::infinity(),
+			py::arg("stats") = py::none());
+
+	m.def("restore_rbox_maps", &lanms_adaptor::restore_rbox_maps,
+			"the candidates merge_rbox_maps would merge, before any NMS",
+			py::arg("score_map"), py::arg("geo_map"),
+			py::arg("score_threshold"), py::arg("scale"));
+
+	py::class_<lanms_adaptor::Workspace>(m, "Workspace",
+			"reusable scratch memory of merge_quadrangle_n9 and merge_rbox_maps; calls on one workspace run one at a time")
+		.def(py::init<>())
+		.def("merge_quadrangle_n9", &lanms_adaptor::workspace_merge_quadrangle_n9,
+				"merge_quadrangle_n9, returning an array backed by the workspace",
+				py::arg("quad_n9"), py::arg("iou_threshold"),
+				py::arg("iou_kernel") = lanms::IOU_CLIPPER,
+				py::arg("nms_mode") = lanms::NMS_SEQUENTIAL, py::arg("num_threads") = 0,
+				py::arg("parallel_locality") = false, py::arg("locality_2d") = false,
+				py::arg("max_output") = 0,
+				py::arg("min_score") = -std::numeric_limits<float>::infinity(),
+				py::arg("stats") = py::none())
+		.def("merge_rbox_maps", &lanms_adaptor::workspace_merge_rbox_maps,
+				"merge_rbox_maps, returning an array backed by the workspace",
+				py::arg("score_map"), py::arg("geo_map"),
+				py::arg("score_threshold"), py::arg("iou_threshold"),
+				py::arg("scale"), py::arg("iou_kernel") = lanms::IOU_CLIPPER,
+				py::arg("nms_mode") = lanms::NMS_SEQUENTIAL, py::arg("num_threads") = 0,
+				py::arg("parallel_locality") = false, py::arg("locality_2d") = false,
+				py::arg("max_output") = 0,
+				py::arg("min_score") = -std::numeric_limits<float>::infinity(),
+				py::arg("stats") = py::none());
+
+	py::class_<lanms_adaptor::IncrementalNMS>(m, "IncrementalNMS",
+			"merge_quadrangle_n9 over a stream of y-ordered batches, emitting final quadrangles early")
+		.def(py::init<float, lanms::IoUKernel, float>(),
+				py::arg("iou_threshold"), py::arg("iou_kernel") = lanms::IOU_CLIPPER,
+				py::arg("min_score") = -std::numeric_limits<float>::infinity())
+		.def("push", &lanms_adaptor::incremental_push,
+				"add quadrangles; returns those that became final",
+				py::arg("quad_n9"), py::arg("frontier"))
+		.def("push_rbox_rows", &lanms_adaptor::incremental_push_rbox_rows,
+				"decode and add rows of EAST score/geometry maps; returns the quadrangles that became final",
+				py::arg("score_map"), py::arg("geo_map"), py::arg("row0"),
+				py::arg("score_threshold"), py::arg("scale"), py::arg("frontier"))
+		.def("finish", &lanms_adaptor::incremental_finish,
+				"end of input; returns the remaining quadrangles");
+
+	py::class_<lanms_adaptor::TemporalNMS>(m, "TemporalNMS",
+			"merge_quadrangle_n9 for video, reusing the tracks of the previous frames")
+		.def(py::init<float, float, float, size_t, lanms::IoUKernel, float, size_t>(),
+				py::arg("iou_threshold"), py::arg("match_threshold") = 0.5f,
+				py::arg("smoothing") = 0.5f, py::arg("max_missed") = 0,
+				py::arg("iou_kernel") = lanms::IOU_CLIPPER,
+				py::arg("min_score") = -std::numeric_limits<float>::infinity(),
+				py::arg("max_output") = 0)
+		.def("update", &lanms_adaptor::temporal_update,
+				"process the next frame; returns the quadrangles and ids of the tracks seen in it",
+				py::arg("quad_n9"))
+		.def("reset", &lanms_adaptor::temporal_reset,
+				"forget every track");
+
+	m.def("merge_rbox_n6", &lanms_adaptor::merge_rbox_n6,
+			"merge rotated rectangles",
+			py::arg("rbox_n6"), py::arg("iou_threshold"));
+
+	m.def("merge_rbox_maps_n6", &lanms_adaptor::merge_rbox_maps_n6,
+			"decode EAST score/geometry maps and merge them as rotated rectangles",
+			py::arg("score_map"), py::arg("geo_map"),
+			py::arg("score_threshold"), py::arg("iou_threshold"), py::arg("scale"));
+
+	m.def("rescore_quadrangle_n9", &lanms_adaptor::rescore_quadrangle_n9,
+			"set quadrangle scores to the mean score map value inside them, in place; "
+			"returns the indices of those crossing the map border, which are left as is",
+			py::arg("quad_n9"), py::arg("score_map"),
+			py::arg("scale"), py::arg("num_threads") = 0);
+
+	m.def("synthetic_workload", &lanms_adaptor::synthetic_workload,
+			"the EAST-like candidates of the named generator of lanms/workload.h, as used by bench",
+			py::arg("name"), py::arg("n"), py::arg("seed") = 0);
+	m.attr("WORKLOADS") = py::cast(std::vector<std::string>(
+				std::begin(lanms::workload::NAMES), std::end(lanms::workload::NAMES)));
+
+	m.def("trace_enable", &lanms_adaptor::trace_enable,
+			"start recording spans into a ring buffer of the given capacity",
+			py::arg("capacity") = 1 << 16);
+	m.def("trace_disable", &lanms_adaptor::trace_disable,
+			"stop recording spans");
+	m.def("trace_now", &lanms::trace::Tracer::now,
+			"the clock of the trace timeline, in nanoseconds");
+	m.def("trace_record", &lanms_adaptor::trace_record,
+			"record a span [begin, end) of the calling thread",
+			py::arg("name"), py::arg("begin"), py::arg("end"));
+	m.def("trace_dump", &lanms_adaptor::trace_dump,
+			"the buffered spans ending at or after `since`, as Chrome trace-event JSON",
+			py::arg("since") = 0);
 
 	return m.ptr();
 }
@@ -0,0 +1,260 @@
+/**
+ * Microbenchmarks of the lanms kernels: poly_iou, PolyMerger::add,
+ * standard_nms and merge_quadrangle_n9, on synthetic EAST-like candidate
+ * clouds and on replayed dumps of real ones.
+ *
+ *	make bench && ./bench [-n 100,1000,10000] [-t 0.2] [dump.f32 ...]
+ *
+ * A dump is either a record file of lanms.RecordWriter, each frame of which
+ * is replayed on its own, or the raw float32 n-by-9 array passed to
+ * merge_quadrangle_n9, e.g. written with `boxes.astype('float32').tofile()`.
+ */
+#include "lanms.h"
+#include "record.h"
+#include "workload.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <new>
+#include <string>
+#include <vector>
+
+// count every heap allocation, so kernels can be checked for allocation-free
+// steady states; all forms go through malloc and free, so any new pairs
+// with any delete
+namespace {
+	std::atomic<size_t> nr_allocs(0);
+
+	void *counted_alloc(size_t size) noexcept {
+		nr_allocs.fetch_add(1, std::memory_order_relaxed);
+		return std::malloc(size ? size : 1);
+	}
+
+	// kept out of line: once inlined into a caller, GCC pairs the free with
+	// the builtin operator new and warns about a mismatch
+	__attribute__((noinline)) void release(void *p) noexcept {
+		std::free(p);
+	}
+}
+
+void *operator new(size_t size) {
+	if (void *p = counted_alloc(size))
+		return p;
+	throw std::bad_alloc();
+}
+
+void *operator new[](size_t size) {
+	if (void *p = counted_alloc(size))
+		return p;
+	throw std::bad_alloc();
+}
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept {
+	return counted_alloc(size);
+}
+
+void *operator new[](size_t size, const std::nothrow_t &) noexcept {
+	return counted_alloc(size);
+}
+
+void operator delete(void *p) noexcept {
+	release(p);
+}
+
+void operator delete[](void *p) noexcept {
+	release(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+	release(p);
+}
+
+void operator delete[](void *p, size_t) noexcept {
+	release(p);
+}
+
+void operator delete(void *p, const std::nothrow_t &) noexcept {
+	release(p);
+}
+
+void operator delete[](void *p, const std::nothrow_t &) noexcept {
+	release(p);
+}
+
+namespace lanms_bench {
+
+	using Clock = std::chrono::steady_clock;
+
+	/**
+	 * A candidate cloud, in the row-major order EAST emits it.
+	 */
+	struct Workload {
+		std::string name;
+		std::vector<float> data;
+
+		size_t size() const {
+			return data.size() / 9;
+		}
+	};
+
+	bool load_dump(const std::string &path, std::vector<Workload> &ret) {
+		std::string name = path.substr(path.find_last_of('/') + 1);
+		if (lanms::record::is_record_file(path)) {
+			std::vector<lanms::record::Frame> frames;
+			if (!lanms::record::read_frames(path, frames))
+				return false;
+			for (size_t i = 0; i < frames.size(); i ++)
+				ret.push_back(Workload{name + "#" + std::to_string(i), std::move(frames[i].boxes)});
+			return true;
+		}
+
+		std::ifstream f(path, std::ios::binary | std::ios::ate);
+		if (!f)
+			return false;
+		std::streamsize bytes = f.tellg();
+		if (bytes % (9 * sizeof(float)) != 0)
+			return false;
+		f.seekg(0);
+		Workload w{name, std::vector<float>(bytes / sizeof(float))};
+		if (!f.read(reinterpret_cast<char *>(w.data.data()), bytes))
+			return false;
+		ret.push_back(std::move(w));
+		return true;
+	}
+
+	std::vector<lanms::Polygon> to_polys(const Workload &w) {
+		std::vector<lanms::Polygon> polys;
+		polys.reserve(w.size());
+		for (size_t i = 0; i < w.size(); i ++) {
+			auto p = &w.data[i * 9];
+			polys.push_back(lanms::Polygon{
+					lanms::make_quad(p[0], p[1], p[2], p[3], p[4], p[5], p[6], p[7]),
+					p[8]});
+		}
+		return polys;
+	}
+
+	double min_time = 0.2;
+	volatile float sink;
+
+	/**
+	 * Time f(), called until min_time has passed, and print the cost per
+	 * item for `items` items per call.
+	 */
+	template<typename F>
+	void run(const Workload &w, const char *bench, const char *unit, size_t items, F &&f) {
+		f();	// warm up, and let workspaces grow
+		size_t reps = 0;
+		size_t allocs = nr_allocs.load();
+		auto start = Clock::now();
+		double elapsed;
+		do {
+			f();
+			reps ++;
+			elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+		} while (elapsed < min_time);
+		allocs = nr_allocs.load() - allocs;
+		double per_call = elapsed / reps;
+		std::printf("%-16s %7zu  %-24s %10.1f ns/%-5s %12.0f %s/s %10.1f allocs/call\n",
+				w.name.c_str(), w.size(), bench, per_call * 1e9 / std::max<size_t>(items, 1), unit,
+				items / per_call, unit, double(allocs) / reps);
+	}
+
+	void bench_workload(const Workload &w) {
+		auto polys = to_polys(w);
+		size_t n = polys.size();
+		if (n < 2)
+			return;
+
+		// neighbours in scan order: the pairs the locality-aware pass compares
+		run(w, "poly_iou/clipper", "pair", n - 1, [&]() {
+			float s = 0;
+			for (size_t i = 1; i < n; i ++)
+				s += lanms::poly_iou(polys[i - 1], polys[i]);
+			sink = s;
+		});
+		run(w, "poly_iou/convex_quad", "pair", n - 1, [&]() {
+			float s = 0;
+			for (size_t i = 1; i < n; i ++)
+				s += lanms::convex_quad_iou(polys[i - 1], polys[i]);
+			sink = s;
+		});
+		run(w, "PolyMerger::add", "add", n, [&]() {
+			float s = 0;
+			lanms::PolyMerger merger;
+			for (size_t i = 0; i < n; i ++) {
+				merger.add(polys[i]);
+				if (i % 16 == 15) {
+					s += merger.get().score;
+					merger = lanms::PolyMerger();
+				}
+			}
+			sink = s;
+		});
+
+		lanms::Workspace ws;
+		float thr = 0.3f;
+		run(w, "standard_nms/clipper", "box", n, [&]() {
+			sink = float(lanms::standard_nms<lanms::ClipperIoU>(polys, thr, lanms::HardSuppression(),
+						lanms::NmsOptions(), ws).size());
+		});
+		run(w, "standard_nms/convex_quad", "box", n, [&]() {
+			sink = float(lanms::standard_nms<lanms::ConvexQuadIoU>(polys, thr, lanms::HardSuppression(),
+						lanms::NmsOptions(), ws).size());
+		});
+		for (auto kernel: {lanms::IOU_CLIPPER, lanms::IOU_CONVEX_QUAD}) {
+			const char *name = kernel == lanms::IOU_CLIPPER ? "clipper" : "convex_quad";
+			lanms::NmsOptions opts(kernel);
+			run(w, (std::string("merge_n9/") + name).c_str(), "box", n, [&]() {
+				sink = float(lanms::merge_quadrangle_n9(w.data.data(), n, thr, opts).size());
+			});
+			run(w, (std::string("merge_n9/") + name + "+ws").c_str(), "box", n, [&]() {
+				sink = float(lanms::merge_quadrangle_n9(w.data.data(), n, thr, opts, ws).size());
+			});
+		}
+	}
+
+	std::vector<size_t> parse_sizes(const char *s) {
+		std::vector<size_t> ret;
+		for (char *end; *s; s = *end ? end + 1 : end)
+			ret.push_back(std::strtoul(s, &end, 10));
+		return ret;
+	}
+}
+
+int main(int argc, char **argv) {
+	using namespace lanms_bench;
+	std::vector<size_t> sizes{100, 1000, 10000};
+	std::vector<std::string> dumps;
+	for (int i = 1; i < argc; i ++) {
+		if (std::strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+			sizes = parse_sizes(argv[++ i]);
+		else if (std::strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+			min_time = std::atof(argv[++ i]);
+		else
+			dumps.push_back(argv[i]);
+	}
+
+	for (auto &&path: dumps) {
+		std::vector<Workload> ws;
+		if (!load_dump(path, ws)) {
+			std::fprintf(stderr, "cannot read a record file or n-by-9 float32 dump from %s\n", path.c_str());
+			return 1;
+		}
+		for (auto &&w: ws)
+			bench_workload(w);
+	}
+	if (!dumps.empty())
+		return 0;
+
+	for (size_t n: sizes) {
+		bench_workload(Workload{"dense_lines", lanms::workload::dense_lines(n, 1)});
+		bench_workload(Workload{"rotated_signage", lanms::workload::rotated_signage(n, 2)});
+		bench_workload(Workload{"sparse_scene", lanms::workload::sparse_scene(n, 3)});
+	}
+	return 0;
+}
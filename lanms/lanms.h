@@ -2,14 +2,84 @@
 #pragma once
 
 #include "clipper/clipper.hpp"
+#include "thread_pool.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <iterator>
+#include <limits>
+#include <memory>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define LANMS_HAVE_AVX2 1
+#include <immintrin.h>
+#else
+#define LANMS_HAVE_AVX2 0
+#endif
 
 // locality-aware NMS
 namespace lanms {
 
 	namespace cl = ClipperLib;
 
+	/**
+	 * Call f(begin, end) on contiguous chunks of [0, n), one chunk per
+	 * thread of the shared ThreadPool. num_threads == 0 means one thread per
+	 * hardware core.
+	 */
+	template<typename F>
+	void parallel_for(size_t n, size_t num_threads, F &&f) {
+		if (num_threads == 0)
+			num_threads = std::max(1u, std::thread::hardware_concurrency());
+		num_threads = std::min(num_threads, n);
+		if (num_threads <= 1) {
+			f(size_t(0), n);
+			return;
+		}
+
+		ThreadPool::instance().run(num_threads, num_threads, [&](size_t t) {
+			f(n * t / num_threads, n * (t + 1) / num_threads);
+		});
+	}
+
+	/**
+	 * The four vertices of a quadrangle, in input image coordinates, with
+	 * all x coordinates and all y coordinates stored contiguously so each
+	 * axis can be loaded at once. Trivially copyable; it is only converted
+	 * to a ClipperLib path when the general polygon clipper is actually
+	 * used.
+	 */
+	struct Quad {
+		float x[4], y[4];
+	};
+
+	inline Quad make_quad(float x0, float y0, float x1, float y1,
+			float x2, float y2, float x3, float y3) {
+		return Quad{{x0, x1, x2, x3}, {y0, y1, y2, y3}};
+	}
+
+	/**
+	 * ClipperLib works on integer coordinates; quadrangles are scaled by
+	 * this factor on the way in, which keeps 1e-4 pixel of resolution.
+	 */
+	const double CLIPPER_SCALE = 10000;
+
+	inline cl::IntPoint to_int_point(float x, float y) {
+		return cl::IntPoint(cl::cInt(std::llround(x * CLIPPER_SCALE)), cl::cInt(std::llround(y * CLIPPER_SCALE)));
+	}
+
+	inline cl::Path to_path(const Quad &q) {
+		return cl::Path{
+			to_int_point(q.x[0], q.y[0]), to_int_point(q.x[1], q.y[1]),
+			to_int_point(q.x[2], q.y[2]), to_int_point(q.x[3], q.y[3])};
+	}
+
 	struct Polygon {
-		cl::Path poly;
+		Quad poly;
 		float score;
 	};
 
@@ -22,8 +92,8 @@ namespace lanms {
 
 	float poly_iou(const Polygon &a, const Polygon &b) {
 		cl::Clipper clpr;
-		clpr.AddPath(a.poly, cl::ptSubject, true);
-		clpr.AddPath(b.poly, cl::ptClip, true);
+		clpr.AddPath(to_path(a.poly), cl::ptSubject, true);
+		clpr.AddPath(to_path(b.poly), cl::ptClip, true);
 
 		cl::Paths inter, uni;
 		clpr.Execute(cl::ctIntersection, inter, cl::pftEvenOdd);
@@ -34,8 +104,114 @@ namespace lanms {
 		return std::abs(inter_area) / std::max(std::abs(uni_area), 1.0f);
 	}
 
-	bool should_merge(const Polygon &a, const Polygon &b, float iou_threshold) {
-		return poly_iou(a, b) > iou_threshold;
+	/**
+	 * IoU kernels selectable by the NMS routines.
+	 */
+	enum IoUKernel {
+		IOU_CLIPPER = 0,		// general polygons, via ClipperLib
+		IOU_CONVEX_QUAD = 1,	// closed-form clipping of convex quadrangles
+	};
+
+	namespace convex {
+
+		struct Point {
+			double x, y;
+		};
+
+		inline double cross(const Point &o, const Point &a, const Point &b) {
+			return (a.x - o.x) * (b.y - o.y) - (a.y - o.y) * (b.x - o.x);
+		}
+
+		inline double signed_area(const Point *p, size_t n) {
+			double area = 0;
+			for (size_t i = 0, j = n - 1; i < n; j = i ++)
+				area += p[j].x * p[i].y - p[i].x * p[j].y;
+			return area * 0.5;
+		}
+
+		/**
+		 * Copy a quadrangle into counter-clockwise order. Returns false if it
+		 * is not convex, in which case the caller has to fall back to a
+		 * general polygon clipper.
+		 */
+		inline bool load_quad(const Quad &quad, Point *q, double &area) {
+			for (size_t i = 0; i < 4; i ++)
+				q[i] = Point{double(quad.x[i]), double(quad.y[i])};
+
+			bool has_pos = false, has_neg = false;
+			for (size_t i = 0; i < 4; i ++) {
+				auto c = cross(q[i], q[(i + 1) % 4], q[(i + 2) % 4]);
+				has_pos |= c > 0;
+				has_neg |= c < 0;
+			}
+			if (has_pos && has_neg)
+				return false;
+
+			area = signed_area(q, 4);
+			if (area < 0) {
+				std::swap(q[1], q[3]);
+				area = -area;
+			}
+			return true;
+		}
+
+		/**
+		 * Sutherland-Hodgman step: keep the part of `in` on the left of the
+		 * directed edge a->b. Writes at most n + 1 vertices to `out`.
+		 */
+		inline size_t clip(const Point *in, size_t n, const Point &a, const Point &b, Point *out) {
+			size_t m = 0;
+			for (size_t i = 0, j = n - 1; i < n; j = i ++) {
+				auto &p = in[j], &q = in[i];
+				auto dp = cross(a, b, p), dq = cross(a, b, q);
+				if (dp >= 0)
+					out[m ++] = p;
+				if ((dp > 0 && dq < 0) || (dp < 0 && dq > 0)) {
+					auto t = dp / (dp - dq);
+					out[m ++] = Point{p.x + (q.x - p.x) * t, p.y + (q.y - p.y) * t};
+				}
+			}
+			return m;
+		}
+
+		/**
+		 * Intersection area of two counter-clockwise convex quadrangles.
+		 */
+		inline double intersection_area(const Point *a, const Point *b) {
+			// every clipping step adds at most one vertex: 4 + 4 = 8
+			Point buf[2][8];
+			size_t n = 4;
+			std::copy(a, a + 4, buf[0]);
+			for (size_t i = 0; i < 4 && n > 0; i ++)
+				n = clip(buf[i & 1], n, b[i], b[(i + 1) % 4], buf[(i + 1) & 1]);
+			return n < 3 ? 0 : std::abs(signed_area(buf[0], n));
+		}
+	}
+
+	/**
+	 * IoU of two convex quadrangles, computed on the stack without any heap
+	 * allocation. Falls back to poly_iou for non-convex input.
+	 */
+	float convex_quad_iou(const Polygon &a, const Polygon &b) {
+		convex::Point qa[4], qb[4];
+		double area_a, area_b;
+		if (!convex::load_quad(a.poly, qa, area_a) || !convex::load_quad(b.poly, qb, area_b))
+			return poly_iou(a, b);
+		if (area_a == 0 || area_b == 0)
+			return 0;
+
+		auto inter_area = convex::intersection_area(qa, qb),
+			 uni_area = area_a + area_b - inter_area;
+		return uni_area > 0 ? float(inter_area / uni_area) : 0;
+	}
+
+	float poly_iou(const Polygon &a, const Polygon &b, IoUKernel kernel) {
+		return kernel == IOU_CONVEX_QUAD ? convex_quad_iou(a, b) : poly_iou(a, b);
+	}
+
+	bool should_merge(const Polygon &a, const Polygon &b, float iou_threshold,
+			IoUKernel kernel = IOU_CLIPPER) {
+		return poly_iou(a, b, kernel) > iou_threshold;
 	}
 
 	/**
@@ -61,46 +237,45 @@ namespace lanms {
 				} else {
 					p = p_given;
 				}
-				assert(p.poly.size() == 4);
 				auto &poly = p.poly;
-				auto s = p.score;
-				data[0] += poly[0].X * s;
-				data[1] += poly[0].Y * s;
+				double s = p.score;
+				data[0] += poly.x[0] * s;
+				data[1] += poly.y[0] * s;
 
-				data[2] += poly[1].X * s;
-				data[3] += poly[1].Y * s;
+				data[2] += poly.x[1] * s;
+				data[3] += poly.y[1] * s;
 
-				data[4] += poly[2].X * s;
-				data[5] += poly[2].Y * s;
+				data[4] += poly.x[2] * s;
+				data[5] += poly.y[2] * s;
 
-				data[6] += poly[3].X * s;
-				data[7] += poly[3].Y * s;
+				data[6] += poly.x[3] * s;
+				data[7] += poly.y[3] * s;
 
 				score += p.score;
 
 				nr_polys += 1;
 			}
 
-			inline std::int64_t sqr(std::int64_t x) { return x * x; }
+			inline double sqr(double x) { return x * x; }
 
 			Polygon normalize_poly(
 					const Polygon &ref,
 					const Polygon &p) {
 
-				std::int64_t min_d = std::numeric_limits<std::int64_t>::max();
+				double min_d = std::numeric_limits<double>::max();
 				size_t best_start = 0, best_order = 0;
 
 				for (size_t start = 0; start < 4; start ++) {
 					size_t j = start;
-					std::int64_t d = (
-							sqr(ref.poly[(j + 0) % 4].X - p.poly[(j + 0) % 4].X)
-							+ sqr(ref.poly[(j + 0) % 4].Y - p.poly[(j + 0) % 4].Y)
-							+ sqr(ref.poly[(j + 1) % 4].X - p.poly[(j + 1) % 4].X)
-							+ sqr(ref.poly[(j + 1) % 4].Y - p.poly[(j + 1) % 4].Y)
-							+ sqr(ref.poly[(j + 2) % 4].X - p.poly[(j + 2) % 4].X)
-							+ sqr(ref.poly[(j + 2) % 4].Y - p.poly[(j + 2) % 4].Y)
-							+ sqr(ref.poly[(j + 3) % 4].X - p.poly[(j + 3) % 4].X)
-							+ sqr(ref.poly[(j + 3) % 4].Y - p.poly[(j + 3) % 4].Y)
+					double d = (
+							sqr(ref.poly.x[(j + 0) % 4] - p.poly.x[(j + 0) % 4])
+							+ sqr(ref.poly.y[(j + 0) % 4] - p.poly.y[(j + 0) % 4])
+							+ sqr(ref.poly.x[(j + 1) % 4] - p.poly.x[(j + 1) % 4])
+							+ sqr(ref.poly.y[(j + 1) % 4] - p.poly.y[(j + 1) % 4])
+							+ sqr(ref.poly.x[(j + 2) % 4] - p.poly.x[(j + 2) % 4])
+							+ sqr(ref.poly.y[(j + 2) % 4] - p.poly.y[(j + 2) % 4])
+							+ sqr(ref.poly.x[(j + 3) % 4] - p.poly.x[(j + 3) % 4])
+							+ sqr(ref.poly.y[(j + 3) % 4] - p.poly.y[(j + 3) % 4])
 							);
 					if (d < min_d) {
 						min_d = d;
@@ -109,14 +284,14 @@ namespace lanms {
 					}
 
 					d = (
-							sqr(ref.poly[(j + 0) % 4].X - p.poly[(j + 3) % 4].X)
-							+ sqr(ref.poly[(j + 0) % 4].Y - p.poly[(j + 3) % 4].Y)
-							+ sqr(ref.poly[(j + 1) % 4].X - p.poly[(j + 2) % 4].X)
-							+ sqr(ref.poly[(j + 1) % 4].Y - p.poly[(j + 2) % 4].Y)
-							+ sqr(ref.poly[(j + 2) % 4].X - p.poly[(j + 1) % 4].X)
-							+ sqr(ref.poly[(j + 2) % 4].Y - p.poly[(j + 1) % 4].Y)
-							+ sqr(ref.poly[(j + 3) % 4].X - p.poly[(j + 0) % 4].X)
-							+ sqr(ref.poly[(j + 3) % 4].Y - p.poly[(j + 0) % 4].Y)
+							sqr(ref.poly.x[(j + 0) % 4] - p.poly.x[(j + 3) % 4])
+							+ sqr(ref.poly.y[(j + 0) % 4] - p.poly.y[(j + 3) % 4])
+							+ sqr(ref.poly.x[(j + 1) % 4] - p.poly.x[(j + 2) % 4])
+							+ sqr(ref.poly.y[(j + 1) % 4] - p.poly.y[(j + 2) % 4])
+							+ sqr(ref.poly.x[(j + 2) % 4] - p.poly.x[(j + 1) % 4])
+							+ sqr(ref.poly.y[(j + 2) % 4] - p.poly.y[(j + 1) % 4])
+							+ sqr(ref.poly.x[(j + 3) % 4] - p.poly.x[(j + 0) % 4])
+							+ sqr(ref.poly.y[(j + 3) % 4] - p.poly.y[(j + 0) % 4])
 						);
 					if (d < min_d) {
 						min_d = d;
@@ -126,14 +301,17 @@ namespace lanms {
 				}
 
 				Polygon r;
-				r.poly.resize(4);
 				auto j = best_start;
 				if (best_order == 0) {
-					for (size_t i = 0; i < 4; i ++)
-						r.poly[i] = p.poly[(j + i) % 4];
+					for (size_t i = 0; i < 4; i ++) {
+						r.poly.x[i] = p.poly.x[(j + i) % 4];
+						r.poly.y[i] = p.poly.y[(j + i) % 4];
+					}
 				} else {
-					for (size_t i = 0; i < 4; i ++)
-						r.poly[i] = p.poly[(j + 4 - i - 1) % 4];
+					for (size_t i = 0; i < 4; i ++) {
+						r.poly.x[i] = p.poly.x[(j + 4 - i - 1) % 4];
+						r.poly.y[i] = p.poly.y[(j + 4 - i - 1) % 4];
+					}
 				}
 				r.score = p.score;
 				return r;
@@ -143,93 +321,2399 @@ namespace lanms {
 				Polygon p;
 
 				auto &poly = p.poly;
-				poly.resize(4);
-				auto score_inv = 1.0f / std::max(1e-8f, score);
-				poly[0].X = data[0] * score_inv;
-				poly[0].Y = data[1] * score_inv;
-				poly[1].X = data[2] * score_inv;
-				poly[1].Y = data[3] * score_inv;
-				poly[2].X = data[4] * score_inv;
-				poly[2].Y = data[5] * score_inv;
-				poly[3].X = data[6] * score_inv;
-				poly[3].Y = data[7] * score_inv;
+				auto score_inv = 1.0 / std::max(1e-8, score);
+				poly.x[0] = data[0] * score_inv;
+				poly.y[0] = data[1] * score_inv;
+				poly.x[1] = data[2] * score_inv;
+				poly.y[1] = data[3] * score_inv;
+				poly.x[2] = data[4] * score_inv;
+				poly.y[2] = data[5] * score_inv;
+				poly.x[3] = data[6] * score_inv;
+				poly.y[3] = data[7] * score_inv;
 
 				assert(score > 0);
-				p.score = score;
+				p.score = float(score);
 
 				return p;
 			}
 
 		private:
-			std::int64_t data[8];
-			float score;
+			double data[8];
+			double score;
 			std::int32_t nr_polys;
 	};
 
 
 	/**
-	 * The standard NMS algorithm.
+	 * Axis-aligned bounding box of a polygon.
 	 */
-	std::vector<Polygon> standard_nms(std::vector<Polygon> &polys, float iou_threshold) {
-		size_t n = polys.size();
-		if (n == 0)
-			return {};
-		std::vector<size_t> indices(n);
-		std::iota(std::begin(indices), std::end(indices), 0);
-		std::sort(std::begin(indices), std::end(indices), [&](size_t i, size_t j) { return polys[i].score > polys[j].score; });
+	struct AABB {
+		float x0, y0, x1, y1;
+
+		AABB(float x0, float y0, float x1, float y1): x0(x0), y0(y0), x1(x1), y1(y1) {}
+
+		AABB(const Quad &q):
+			x0(std::min(std::min(q.x[0], q.x[1]), std::min(q.x[2], q.x[3]))),
+			y0(std::min(std::min(q.y[0], q.y[1]), std::min(q.y[2], q.y[3]))),
+			x1(std::max(std::max(q.x[0], q.x[1]), std::max(q.x[2], q.x[3]))),
+			y1(std::max(std::max(q.y[0], q.y[1]), std::max(q.y[2], q.y[3]))) {}
+
+		bool overlaps(const AABB &o) const {
+			return x0 <= o.x1 && o.x0 <= x1 && y0 <= o.y1 && o.y0 <= y1;
+		}
+	};
+
+	/**
+	 * Uniform grid over the bounding boxes of a set of polygons. Each
+	 * polygon is registered in every cell its box touches; a query visits
+	 * only the cells under the query box, so the cost of a query scales
+	 * with the local density instead of the total number of polygons.
+	 */
+	class PolyGrid {
+		public:
+			PolyGrid(): single_cell(false), nx(1), ny(1), ox(0), oy(0), cw(1), ch(1) {}
+
+			/**
+			 * \param single_cell put everything into one cell, which turns
+			 *		every query into a full scan
+			 */
+			PolyGrid(const std::vector<Polygon> &polys, bool single_cell = false) {
+				assign(polys, single_cell);
+			}
+
+			/**
+			 * Grid over arbitrary bounding boxes, one per item.
+			 */
+			PolyGrid(std::vector<AABB> boxes_, bool single_cell = false):
+				boxes(std::move(boxes_)) {
+				build(single_cell);
+			}
+
+			/**
+			 * Rebuild the grid over another set of polygons, reusing the
+			 * memory of the previous one.
+			 */
+			void assign(const std::vector<Polygon> &polys, bool single_cell = false) {
+				boxes.clear();
+				for (auto &&p: polys)
+					boxes.emplace_back(p.poly);
+				build(single_cell);
+			}
+
+			/**
+			 * Call f(j) once for every polygon j whose bounding box overlaps
+			 * that of polygon i (including i itself), or for every polygon if
+			 * the grid was built as a single cell. Returns the number of
+			 * polygons of the visited cells skipped for a disjoint bounding
+			 * box.
+			 */
+			template<typename F>
+			size_t visit(size_t i, F &&f) {
+				return visit(i, stamp, f);
+			}
+
+			/**
+			 * Same as visit(i, f), but deduplicates through the caller's
+			 * `stamp` (n entries, initialised to SIZE_MAX) instead of the
+			 * grid's own, so several threads can query concurrently.
+			 */
+			template<typename F>
+			size_t visit(size_t i, std::vector<size_t> &stamp, F &&f) const {
+				return query(boxes[i], i, stamp, f);
+			}
+
+			/**
+			 * Call f(j) once for every polygon j whose bounding box overlaps
+			 * `box`, which need not belong to the grid. Deduplicates through
+			 * `stamp` as visit() does; `key` must differ from the one of the
+			 * previous query through the same stamp.
+			 */
+			template<typename F>
+			size_t query(const AABB &box, size_t key, std::vector<size_t> &stamp, F &&f) const {
+				size_t rejects = 0;
+				for_cells(box, [&](size_t c) {
+					for (size_t k = offsets[c]; k < offsets[c + 1]; k ++) {
+						auto j = items[k];
+						if (stamp[j] == key)
+							continue;
+						if (!single_cell && !box.overlaps(boxes[j])) {
+							rejects ++;
+							continue;
+						}
+						stamp[j] = key;
+						f(j);
+					}
+				});
+				return rejects;
+			}
+
+		private:
+			void build(bool single_cell_) {
+				single_cell = single_cell_;
+				size_t n = boxes.size();
+				stamp.assign(n, std::numeric_limits<size_t>::max());
 
-		std::vector<size_t> keep;
-		while (indices.size()) {
-			size_t p = 0, cur = indices[0];
-			keep.emplace_back(cur);
-			for (size_t i = 1; i < indices.size(); i ++) {
-				if (!should_merge(polys[cur], polys[indices[i]], iou_threshold)) {
-					indices[p ++] = indices[i];
+				nx = ny = 1;
+				ox = oy = 0;
+				cw = ch = 1;
+				if (n > 0 && !single_cell) {
+					double mean_w = 0, mean_h = 0;
+					float x0 = boxes[0].x0, y0 = boxes[0].y0, x1 = boxes[0].x1, y1 = boxes[0].y1;
+					for (auto &&b: boxes) {
+						mean_w += double(b.x1 - b.x0);
+						mean_h += double(b.y1 - b.y0);
+						x0 = std::min(x0, b.x0);
+						y0 = std::min(y0, b.y0);
+						x1 = std::max(x1, b.x1);
+						y1 = std::max(y1, b.y1);
+					}
+					mean_w /= n;
+					mean_h /= n;
+
+					// cells of roughly one average box, but never more
+					// cells along an axis than 2 * sqrt(n)
+					size_t max_cells = size_t(2 * std::sqrt(double(n))) + 1;
+					ox = double(x0);
+					oy = double(y0);
+					nx = cells_along(double(x1 - x0), mean_w, max_cells);
+					ny = cells_along(double(y1 - y0), mean_h, max_cells);
+					cw = std::max(double(x1 - x0) / nx, 1e-6);
+					ch = std::max(double(y1 - y0) / ny, 1e-6);
 				}
+
+				// bucket the polygons in a compressed (CSR) layout
+				offsets.assign(nx * ny + 1, 0);
+				for (auto &&b: boxes)
+					for_cells(b, [&](size_t c) { offsets[c + 1] ++; });
+				for (size_t c = 0; c < nx * ny; c ++)
+					offsets[c + 1] += offsets[c];
+				items.resize(offsets.back());
+				fill.assign(offsets.begin(), offsets.end() - 1);
+				for (size_t i = 0; i < n; i ++)
+					for_cells(boxes[i], [&](size_t c) { items[fill[c] ++] = i; });
+			}
+
+			static size_t cells_along(double extent, double mean_size, size_t max_cells) {
+				if (mean_size <= 0)
+					return max_cells;
+				return std::max<size_t>(1, std::min<size_t>(max_cells, size_t(extent / mean_size)));
+			}
+
+			size_t cell_index(double v, double origin, double size, size_t count) const {
+				auto c = (v - origin) / size;
+				return c <= 0 ? 0 : std::min(count - 1, size_t(c));
+			}
+
+			template<typename F>
+			void for_cells(const AABB &b, F &&f) const {
+				size_t cx0 = cell_index(double(b.x0), ox, cw, nx), cx1 = cell_index(double(b.x1), ox, cw, nx),
+					   cy0 = cell_index(double(b.y0), oy, ch, ny), cy1 = cell_index(double(b.y1), oy, ch, ny);
+				for (size_t cy = cy0; cy <= cy1; cy ++)
+					for (size_t cx = cx0; cx <= cx1; cx ++)
+						f(cy * nx + cx);
+			}
+
+			std::vector<AABB> boxes;
+			std::vector<size_t> offsets, items, stamp, fill;
+			bool single_cell;
+			size_t nx, ny;
+			double ox, oy, cw, ch;
+	};
+
+
+	namespace batch {
+
+		/**
+		 * Doubled signed-area contribution of the edge p -> p + d after
+		 * clipping it to the counter-clockwise convex polygon q. Summing this
+		 * over the edges of two convex polygons, each clipped to the other,
+		 * gives twice their intersection area (Green's theorem). An edge
+		 * lying on an edge of q counts only for the `owner` polygon and only
+		 * if both run in the same direction, so shared boundaries are counted
+		 * exactly once.
+		 */
+		inline float clipped_edge(float px, float py, float dx, float dy,
+				const float *qx, const float *qy, bool owner) {
+			float t0 = 0, t1 = 1;
+			for (size_t k = 0; k < 4; k ++) {
+				float ex = qx[k + 1] - qx[k], ey = qy[k + 1] - qy[k];
+				float num = ex * (py - qy[k]) - ey * (px - qx[k]);
+				float den = ex * dy - ey * dx;
+				if (den > 0)
+					t0 = std::max(t0, -num / den);
+				else if (den < 0)
+					t1 = std::min(t1, -num / den);
+				else if (num < 0 || (num == 0 && !(owner && ex * dx + ey * dy > 0)))
+					t1 = -1;
 			}
-			indices.resize(p);
+			return t1 > t0 ? (t1 - t0) * (px * dy - py * dx) : 0;
 		}
 
-		std::vector<Polygon> ret;
-		for (auto &&i: keep) {
-			ret.emplace_back(polys[i]);
+		inline float intersection_area(const float *ax, const float *ay, const float *bx, const float *by) {
+			float sum = 0;
+			for (size_t k = 0; k < 4; k ++)
+				sum += clipped_edge(ax[k], ay[k], ax[k + 1] - ax[k], ay[k + 1] - ay[k], bx, by, true);
+			for (size_t k = 0; k < 4; k ++)
+				sum += clipped_edge(bx[k], by[k], bx[k + 1] - bx[k], by[k + 1] - by[k], ax, ay, false);
+			return std::max(sum * 0.5f, 0.0f);
 		}
-		return ret;
+
+#if LANMS_HAVE_AVX2
+		/**
+		 * clipped_edge for 8 lanes at once; performs the same float
+		 * operations in the same order, so results match bit for bit.
+		 */
+		__attribute__((target("avx2")))
+		inline __m256 clipped_edge_avx2(__m256 px, __m256 py, __m256 dx, __m256 dy,
+				const __m256 *qx, const __m256 *qy, bool owner) {
+			const __m256 zero = _mm256_setzero_ps(), sign = _mm256_set1_ps(-0.0f);
+			__m256 t0 = zero, t1 = _mm256_set1_ps(1), empty = zero;
+			for (size_t k = 0; k < 4; k ++) {
+				auto ex = _mm256_sub_ps(qx[k + 1], qx[k]), ey = _mm256_sub_ps(qy[k + 1], qy[k]);
+				auto num = _mm256_sub_ps(
+						_mm256_mul_ps(ex, _mm256_sub_ps(py, qy[k])),
+						_mm256_mul_ps(ey, _mm256_sub_ps(px, qx[k])));
+				auto den = _mm256_sub_ps(_mm256_mul_ps(ex, dy), _mm256_mul_ps(ey, dx));
+				auto r = _mm256_div_ps(_mm256_xor_ps(num, sign), den);
+				t0 = _mm256_blendv_ps(t0, _mm256_max_ps(t0, r), _mm256_cmp_ps(den, zero, _CMP_GT_OQ));
+				t1 = _mm256_blendv_ps(t1, _mm256_min_ps(t1, r), _mm256_cmp_ps(den, zero, _CMP_LT_OQ));
+
+				auto outside = _mm256_cmp_ps(num, zero, _CMP_LT_OQ);
+				if (owner) {
+					auto dot = _mm256_add_ps(_mm256_mul_ps(ex, dx), _mm256_mul_ps(ey, dy));
+					outside = _mm256_or_ps(outside, _mm256_andnot_ps(
+								_mm256_cmp_ps(dot, zero, _CMP_GT_OQ),
+								_mm256_cmp_ps(num, zero, _CMP_EQ_OQ)));
+				} else {
+					outside = _mm256_or_ps(outside, _mm256_cmp_ps(num, zero, _CMP_EQ_OQ));
+				}
+				empty = _mm256_or_ps(empty, _mm256_and_ps(outside, _mm256_cmp_ps(den, zero, _CMP_EQ_OQ)));
+			}
+			auto len = _mm256_andnot_ps(empty, _mm256_sub_ps(t1, t0));
+			len = _mm256_and_ps(len, _mm256_cmp_ps(t1, t0, _CMP_GT_OQ));
+			return _mm256_mul_ps(len, _mm256_sub_ps(_mm256_mul_ps(px, dy), _mm256_mul_ps(py, dx)));
+		}
+#endif
 	}
 
-	std::vector<Polygon>
-		merge_quadrangle_n9(const float *data, size_t n, float iou_threshold) {
-			using cInt = cl::cInt;
+	/**
+	 * Structure-of-arrays copy of a set of quadrangles, used to compute the
+	 * IoU of one polygon against many others in a batch. Vertices are
+	 * stored counter-clockwise, relative to a common origin, as floats.
+	 * The batch runs through an AVX2 kernel when the CPU supports it and
+	 * through the equivalent scalar code otherwise.
+	 */
+	class QuadBatch {
+		public:
+			QuadBatch(): polys(nullptr) {}
 
-			// first pass
-			std::vector<Polygon> polys;
-			for (size_t i = 0; i < n; i ++) {
-				auto p = data + i * 9;
-				Polygon poly{
-					{
-						{cInt(p[0]), cInt(p[1])},
-						{cInt(p[2]), cInt(p[3])},
-						{cInt(p[4]), cInt(p[5])},
-						{cInt(p[6]), cInt(p[7])},
-					},
-					p[8],
-				};
+			QuadBatch(const std::vector<Polygon> &polys) {
+				assign(polys);
+			}
+
+			/**
+			 * Reload from another set of polygons, reusing the memory of the
+			 * previous one.
+			 */
+			void assign(const std::vector<Polygon> &polys) {
+				this->polys = &polys;
+				size_t n = polys.size();
+				for (size_t k = 0; k < 4; k ++) {
+					x[k].resize(n);
+					y[k].resize(n);
+				}
+				bx0.resize(n);
+				by0.resize(n);
+				bx1.resize(n);
+				by1.resize(n);
+				area.resize(n);
+				valid.resize(n);
+				if (n == 0)
+					return;
 
-				if (polys.size()) {
-					// merge with the last one
-					auto &bpoly = polys.back();
-					if (should_merge(poly, bpoly, iou_threshold)) {
-						PolyMerger merger;
-						merger.add(bpoly);
-						merger.add(poly);
-						bpoly = merger.get();
-					} else {
-						polys.emplace_back(poly);
+				double ox = double(polys[0].poly.x[0]), oy = double(polys[0].poly.y[0]);
+				for (size_t i = 0; i < n; i ++) {
+					convex::Point q[4];
+					double a = 0;
+					// non-convex polygons are left to the general clipper
+					valid[i] = convex::load_quad(polys[i].poly, q, a);
+					area[i] = float(a);
+					for (size_t k = 0; k < 4; k ++) {
+						x[k][i] = float(q[k].x - ox);
+						y[k][i] = float(q[k].y - oy);
+					}
+					bx0[i] = std::min(std::min(x[0][i], x[1][i]), std::min(x[2][i], x[3][i]));
+					by0[i] = std::min(std::min(y[0][i], y[1][i]), std::min(y[2][i], y[3][i]));
+					bx1[i] = std::max(std::max(x[0][i], x[1][i]), std::max(x[2][i], x[3][i]));
+					by1[i] = std::max(std::max(y[0][i], y[1][i]), std::max(y[2][i], y[3][i]));
+				}
+			}
+
+			/**
+			 * IoU of polygon i against polygons cand[0..m), written to out.
+			 */
+			void iou(size_t i, const std::int32_t *cand, size_t m, float *out) const {
+				if (!valid[i]) {
+					for (size_t j = 0; j < m; j ++)
+						out[j] = poly_iou((*polys)[i], (*polys)[cand[j]]);
+					return;
+				}
+#if LANMS_HAVE_AVX2
+				static const bool has_avx2 = __builtin_cpu_supports("avx2");
+				if (has_avx2) {
+					iou_avx2(i, cand, m, out);
+					return;
+				}
+#endif
+				iou_scalar(i, cand, m, out);
+			}
+
+		private:
+			void load(size_t i, float kx, float ky, float *qx, float *qy) const {
+				for (size_t k = 0; k < 4; k ++) {
+					qx[k] = x[k][i] - kx;
+					qy[k] = y[k][i] - ky;
+				}
+				qx[4] = qx[0];
+				qy[4] = qy[0];
+			}
+
+			float finish(size_t i, size_t j, float inter) const {
+				if (area[i] == 0 || area[j] == 0)
+					return 0;
+				auto uni = area[i] + area[j] - inter;
+				return uni > 0 ? inter / uni : 0;
+			}
+
+			void iou_scalar(size_t i, const std::int32_t *cand, size_t m, float *out) const {
+				// work relative to the first vertex of polygon i
+				float kx = x[0][i], ky = y[0][i];
+				float ax[5], ay[5], bx[5], by[5];
+				load(i, kx, ky, ax, ay);
+				for (size_t c = 0; c < m; c ++) {
+					size_t j = cand[c];
+					if (!valid[j]) {
+						out[c] = poly_iou((*polys)[i], (*polys)[j]);
+						continue;
+					}
+					if (bx0[j] > bx1[i] || bx0[i] > bx1[j] || by0[j] > by1[i] || by0[i] > by1[j]) {
+						out[c] = 0;
+						continue;
+					}
+					load(j, kx, ky, bx, by);
+					out[c] = finish(i, j, batch::intersection_area(ax, ay, bx, by));
+				}
+			}
+
+#if LANMS_HAVE_AVX2
+			__attribute__((target("avx2")))
+			void iou_avx2(size_t i, const std::int32_t *cand, size_t m, float *out) const {
+				float kx = x[0][i], ky = y[0][i];
+				float ax[5], ay[5];
+				load(i, kx, ky, ax, ay);
+
+				__m256 kax[5], kay[5], kdx[4], kdy[4];
+				for (size_t k = 0; k < 5; k ++) {
+					kax[k] = _mm256_set1_ps(ax[k]);
+					kay[k] = _mm256_set1_ps(ay[k]);
+				}
+				for (size_t k = 0; k < 4; k ++) {
+					kdx[k] = _mm256_set1_ps(ax[k + 1] - ax[k]);
+					kdy[k] = _mm256_set1_ps(ay[k + 1] - ay[k]);
+				}
+				auto vkx = _mm256_set1_ps(kx), vky = _mm256_set1_ps(ky);
+				auto kbx0 = _mm256_set1_ps(bx0[i]), kby0 = _mm256_set1_ps(by0[i]),
+					 kbx1 = _mm256_set1_ps(bx1[i]), kby1 = _mm256_set1_ps(by1[i]);
+				const auto zero = _mm256_setzero_ps();
+
+				size_t c = 0;
+				for (; c + 8 <= m; c += 8) {
+					auto idx = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(cand + c));
+
+					// bounding box reject; skip the batch if nothing overlaps
+					auto hit = _mm256_and_ps(
+							_mm256_and_ps(
+								_mm256_cmp_ps(_mm256_i32gather_ps(bx0.data(), idx, 4), kbx1, _CMP_LE_OQ),
+								_mm256_cmp_ps(kbx0, _mm256_i32gather_ps(bx1.data(), idx, 4), _CMP_LE_OQ)),
+							_mm256_and_ps(
+								_mm256_cmp_ps(_mm256_i32gather_ps(by0.data(), idx, 4), kby1, _CMP_LE_OQ),
+								_mm256_cmp_ps(kby0, _mm256_i32gather_ps(by1.data(), idx, 4), _CMP_LE_OQ)));
+					if (_mm256_movemask_ps(hit) == 0) {
+						_mm256_storeu_ps(out + c, zero);
+						continue;
+					}
+
+					__m256 bx[5], by[5];
+					for (size_t k = 0; k < 4; k ++) {
+						bx[k] = _mm256_sub_ps(_mm256_i32gather_ps(x[k].data(), idx, 4), vkx);
+						by[k] = _mm256_sub_ps(_mm256_i32gather_ps(y[k].data(), idx, 4), vky);
+					}
+					bx[4] = bx[0];
+					by[4] = by[0];
+
+					auto sum = zero;
+					for (size_t k = 0; k < 4; k ++)
+						sum = _mm256_add_ps(sum, batch::clipped_edge_avx2(
+									kax[k], kay[k], kdx[k], kdy[k], bx, by, true));
+					for (size_t k = 0; k < 4; k ++)
+						sum = _mm256_add_ps(sum, batch::clipped_edge_avx2(
+									bx[k], by[k],
+									_mm256_sub_ps(bx[k + 1], bx[k]), _mm256_sub_ps(by[k + 1], by[k]),
+									kax, kay, false));
+					auto inter = _mm256_max_ps(_mm256_mul_ps(sum, _mm256_set1_ps(0.5f)), zero);
+
+					alignas(32) float lane[8];
+					_mm256_store_ps(lane, _mm256_and_ps(inter, hit));
+					for (size_t l = 0; l < 8; l ++) {
+						size_t j = cand[c + l];
+						if (!valid[j])
+							out[c + l] = poly_iou((*polys)[i], (*polys)[j]);
+						else
+							out[c + l] = finish(i, j, lane[l]);
 					}
-				} else {
-					polys.emplace_back(poly);
 				}
+				iou_scalar(i, cand + c, m - c, out + c);
+			}
+#endif
+
+			const std::vector<Polygon> *polys;
+			std::vector<float> x[4], y[4], bx0, by0, bx1, by1, area;
+			std::vector<char> valid;
+	};
+
+
+	/**
+	 * IoU policies of the NMS templates. A policy is built (or reassigned)
+	 * over the whole candidate set and scores one polygon against a batch
+	 * of others from it; pair() scores two loose polygons.
+	 */
+	class ClipperIoU {
+		public:
+			ClipperIoU(): polys(nullptr) {}
+
+			ClipperIoU(const std::vector<Polygon> &polys): polys(&polys) {}
+
+			void assign(const std::vector<Polygon> &polys) {
+				this->polys = &polys;
+			}
+
+			static float pair(const Polygon &a, const Polygon &b) {
+				return poly_iou(a, b);
+			}
+
+			void iou(size_t i, const std::int32_t *cand, size_t m, float *out) const {
+				for (size_t j = 0; j < m; j ++)
+					out[j] = poly_iou((*polys)[i], (*polys)[cand[j]]);
+			}
+
+		private:
+			const std::vector<Polygon> *polys;
+	};
+
+	class ConvexQuadIoU {
+		public:
+			ConvexQuadIoU() {}
+
+			ConvexQuadIoU(const std::vector<Polygon> &polys): quads(polys) {}
+
+			void assign(const std::vector<Polygon> &polys) {
+				quads.assign(polys);
+			}
+
+			static float pair(const Polygon &a, const Polygon &b) {
+				return convex_quad_iou(a, b);
+			}
+
+			void iou(size_t i, const std::int32_t *cand, size_t m, float *out) const {
+				quads.iou(i, cand, m, out);
 			}
-			return standard_nms(polys, iou_threshold);
+
+		private:
+			QuadBatch quads;
+	};
+
+	template<typename IoU>
+	bool should_merge(const Polygon &a, const Polygon &b, float iou_threshold) {
+		return IoU::pair(a, b) > iou_threshold;
+	}
+
+	/**
+	 * Merge policies: how the locality-aware pass folds a candidate into
+	 * the group it overlaps.
+	 */
+
+	// score-weighted average of the vertices, scores summed
+	struct WeightedMerge {
+		static Polygon merge(const Polygon &group, const Polygon &poly) {
+			PolyMerger merger;
+			merger.add(group);
+			merger.add(poly);
+			return merger.get();
+		}
+	};
+
+	// weighted vertices, but the score of the best member, so scores stay
+	// comparable with those of the input
+	struct MaxScoreMerge {
+		static Polygon merge(const Polygon &group, const Polygon &poly) {
+			auto ret = WeightedMerge::merge(group, poly);
+			ret.score = std::max(group.score, poly.score);
+			return ret;
+		}
+	};
+
+	// the best member, unchanged
+	struct KeepBestMerge {
+		static Polygon merge(const Polygon &group, const Polygon &poly) {
+			return poly.score > group.score ? poly : group;
+		}
+	};
+
+	/**
+	 * Suppression policies of the final NMS pass. decay() is the factor
+	 * the score of a candidate is multiplied by when a kept polygon
+	 * overlaps it by `iou`. Soft policies keep every candidate and re-rank
+	 * the rest after each keep.
+	 */
+	struct HardSuppression {
+		static const bool soft = false;
+
+		float decay(float iou, float iou_threshold) const {
+			return iou > iou_threshold ? 0 : 1;
+		}
+	};
+
+	struct LinearSuppression {
+		static const bool soft = true;
+
+		float decay(float iou, float iou_threshold) const {
+			return iou > iou_threshold ? 1 - iou : 1;
+		}
+	};
+
+	struct GaussianSuppression {
+		static const bool soft = true;
+
+		GaussianSuppression(float sigma = 0.5f): sigma(sigma) {}
+
+		float decay(float iou, float) const {
+			return std::exp(-iou * iou / sigma);
+		}
+
+		float sigma;
+	};
+
+	/**
+	 * Suppression algorithms of standard_nms. Both keep exactly the same
+	 * polygons.
+	 */
+	enum NmsMode {
+		NMS_SEQUENTIAL = 0,	// greedy keep-and-filter loop
+		NMS_BITMASK = 1,	// parallel pairwise suppression mask, then a sequential scan
+	};
+
+	/**
+	 * Counters of the NMS entry points, collected only when
+	 * NmsOptions::stats points to one. Every call adds to them, so one
+	 * NmsStats can also sum up several calls.
+	 */
+	struct NmsStats {
+		typedef std::chrono::steady_clock Clock;
+
+		NmsStats():
+			input(0), after_locality(0), merges(0), iou_evals(0), aabb_rejects(0), kept(0),
+			locality_ns(0), nms_setup_ns(0), nms_suppress_ns(0) {}
+
+		static std::uint64_t ns_since(Clock::time_point start) {
+			return std::uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count());
+		}
+
+		// candidates entering the first pass, and groups leaving it
+		std::uint64_t input, after_locality;
+		// candidates the first pass folded into a group
+		std::uint64_t merges;
+		// IoUs computed, in both passes
+		std::uint64_t iou_evals;
+		// neighbours skipped for a disjoint bounding box before any IoU
+		std::uint64_t aabb_rejects;
+		// polygons returned by the final NMS
+		std::uint64_t kept;
+		// time in the first pass, in ordering and indexing the candidates
+		// of the final NMS, and in its suppression loop
+		std::uint64_t locality_ns, nms_setup_ns, nms_suppress_ns;
+	};
+
+	/**
+	 * Runtime options of the NMS entry points.
+	 */
+	struct NmsOptions {
+		NmsOptions(IoUKernel kernel = IOU_CLIPPER, NmsMode mode = NMS_SEQUENTIAL, size_t num_threads = 0):
+			kernel(kernel), mode(mode), num_threads(num_threads),
+			parallel_locality(false), locality_2d(false),
+			max_output(0), min_score(-std::numeric_limits<float>::infinity()),
+			stats(nullptr) {}
+
+		size_t output_limit() const {
+			return max_output ? max_output : std::numeric_limits<size_t>::max();
 		}
+
+		// IoU policy of the non-template entry points
+		IoUKernel kernel;
+		// only applies to hard suppression
+		NmsMode mode;
+		// worker threads for NMS_BITMASK and parallel_locality; 0 uses every core
+		size_t num_threads;
+		// run the locality-aware first pass in horizontal stripes
+		bool parallel_locality;
+		// let the first pass also merge into groups of the previous rows
+		bool locality_2d;
+		// stop after this many keepers; 0 keeps all
+		size_t max_output;
+		// candidates scoring below this are dropped before the final NMS
+		// computes any IoU. A candidate of the final NMS is a group of the
+		// first pass, scored with the sum of its members' scores, so this
+		// floors the sum, not the mean. Soft suppression also drops
+		// candidates once decayed below it
+		float min_score;
+		// counters to add this call to; nullptr skips all bookkeeping
+		NmsStats *stats;
+	};
+
+	/**
+	 * Scratch memory of the NMS entry points, for callers that run them
+	 * over and over, e.g. once per video frame. Buffers only ever grow, so
+	 * once a workspace has seen a frame of the usual size the serial path
+	 * no longer touches the heap; the Clipper IoU kernel, NMS_BITMASK and
+	 * parallel_locality still allocate internally.
+	 *
+	 * Not thread safe: use one workspace per thread.
+	 */
+	struct Workspace {
+		/**
+		 * The IoU policy of the given type, to be assign()ed to the
+		 * candidates.
+		 */
+		template<typename IoU>
+		IoU &scorer();
+
+		// output of the first pass
+		std::vector<Polygon> polys;
+		// output of the final NMS
+		std::vector<Polygon> out;
+
+		std::vector<size_t> indices, rank;
+		std::vector<bool> flags;
+		std::vector<std::int32_t> cand;
+		std::vector<float> ious, scores;
+		std::vector<std::pair<float, size_t>> heap;
+		PolyGrid grid;
+
+		// group boxes and open groups of the two-dimensional first pass
+		std::vector<AABB> boxes;
+		std::vector<size_t> active;
+
+		// scratch of one NMS_BITMASK worker
+		struct MaskWorker {
+			std::vector<size_t> stamp, hits;
+			std::vector<std::int32_t> cand;
+			std::vector<float> ious;
+			// stamp is initialised for the current call
+			bool stamped;
+		};
+		std::vector<MaskWorker> mask_workers;
+
+		// one stripe of the parallel first pass
+		struct LocalityStripe {
+			std::vector<Polygon> polys;
+			// key of the candidate that opened each group
+			std::vector<size_t> starts;
+			size_t input;
+		};
+		std::vector<LocalityStripe> stripes;
+
+		ClipperIoU clipper_scorer;
+		ConvexQuadIoU convex_quad_scorer;
+	};
+
+	template<>
+	ClipperIoU &Workspace::scorer<ClipperIoU>() {
+		return clipper_scorer;
+	}
+
+	template<>
+	ConvexQuadIoU &Workspace::scorer<ConvexQuadIoU>() {
+		return convex_quad_scorer;
+	}
+
+	/**
+	 * Polygon indices in descending score order.
+	 */
+	void score_order(const std::vector<Polygon> &polys, std::vector<size_t> &indices) {
+		indices.resize(polys.size());
+		std::iota(std::begin(indices), std::end(indices), 0);
+		std::sort(std::begin(indices), std::end(indices), [&](size_t i, size_t j) { return polys[i].score > polys[j].score; });
+	}
+
+	/**
+	 * NMS in two phases. First the "IoU above threshold" relation between
+	 * every candidate and the lower-scored candidates around it is computed
+	 * in parallel, as one sparse bitmask row per candidate. Then a cheap
+	 * sequential scan over the rows resolves which candidates survive.
+	 * Keeps the same polygons as the greedy loop of standard_nms, but
+	 * unlike it cannot skip pairs whose lower-scored side is already
+	 * suppressed, so it only pays off with several cores and sparse
+	 * overlaps. With opts.max_output the rows are built in waves, each
+	 * skipping the candidates the earlier ones suppressed, until enough
+	 * polygons are kept.
+	 */
+	template<typename IoU>
+	std::vector<Polygon> &bitmask_nms(const std::vector<Polygon> &polys, float iou_threshold,
+			const NmsOptions &opts, Workspace &ws) {
+		trace::Span span("bitmask_nms");
+		size_t n = polys.size();
+		ws.out.clear();
+		if (n == 0)
+			return ws.out;
+		auto start = opts.stats ? NmsStats::Clock::now() : NmsStats::Clock::time_point();
+		auto &indices = ws.indices, &rank = ws.rank;
+		score_order(polys, indices);
+		rank.resize(n);
+		for (size_t r = 0; r < n; r ++)
+			rank[indices[r]] = r;
+
+		// one 64-bit word of a mask row, covering ranks [word * 64, word * 64 + 64)
+		struct MaskBlock {
+			size_t word;
+			std::uint64_t bits;
+		};
+		// the rows of a contiguous range of ranks, in CSR layout
+		struct MaskChunk {
+			std::vector<size_t> offsets;
+			std::vector<MaskBlock> blocks;
+			size_t iou_evals = 0, aabb_rejects = 0;
+		};
+
+		size_t num_threads = opts.num_threads ? opts.num_threads : std::max(1u, std::thread::hardware_concurrency());
+		size_t nr_chunks = std::min(n, num_threads * 8);
+		std::vector<MaskChunk> chunks(nr_chunks);
+
+		auto &grid = ws.grid;
+		grid.assign(polys, iou_threshold < 0);
+		auto &scorer = ws.scorer<IoU>();
+		scorer.assign(polys);
+		if (opts.stats) {
+			opts.stats->nms_setup_ns += NmsStats::ns_since(start);
+			start = NmsStats::Clock::now();
+		}
+
+		// one task per worker, each pulling chunks until none are left, so
+		// the scratch is set up once per worker rather than once per chunk
+		size_t nr_workers = std::min(num_threads, nr_chunks);
+		if (ws.mask_workers.size() < nr_workers)
+			ws.mask_workers.resize(nr_workers);
+		for (size_t t = 0; t < nr_workers; t ++)
+			ws.mask_workers[t].stamped = false;
+		// rows of ranks already suppressed by the scan are left empty
+		std::vector<std::uint64_t> removed((n + 63) / 64, 0);
+		auto build_rows = [&](size_t first_chunk, size_t end_chunk) {
+			std::atomic<size_t> next_chunk(first_chunk);
+			size_t nr_tasks = std::min(nr_workers, end_chunk - first_chunk);
+			ThreadPool::instance().run(nr_tasks, nr_tasks, [&](size_t t) {
+				auto &worker = ws.mask_workers[t];
+				auto &stamp = worker.stamp, &hits = worker.hits;
+				auto &cand = worker.cand;
+				auto &ious = worker.ious;
+				for (size_t c; (c = next_chunk ++) < end_chunk; ) {
+					trace::Span span("bitmask_nms/rows");
+					// the stamps of a previous call may hold any polygon index
+					if (!worker.stamped) {
+						stamp.assign(n, std::numeric_limits<size_t>::max());
+						worker.stamped = true;
+					}
+					size_t begin = n * c / nr_chunks, end = n * (c + 1) / nr_chunks;
+					auto &chunk = chunks[c];
+					chunk.offsets.emplace_back(0);
+					for (size_t r = begin; r < end; r ++) {
+						if (removed[r / 64] >> (r % 64) & 1) {
+							chunk.offsets.emplace_back(chunk.blocks.size());
+							continue;
+						}
+						size_t cur = indices[r];
+						cand.clear();
+						chunk.aabb_rejects += grid.visit(cur, stamp, [&](size_t j) {
+							if (rank[j] > r)
+								cand.emplace_back(std::int32_t(j));
+						});
+						chunk.iou_evals += cand.size();
+						ious.resize(cand.size());
+						scorer.iou(cur, cand.data(), cand.size(), ious.data());
+
+						hits.clear();
+						for (size_t k = 0; k < cand.size(); k ++)
+							if (ious[k] > iou_threshold)
+								hits.emplace_back(rank[cand[k]]);
+						std::sort(hits.begin(), hits.end());
+						for (auto &&h: hits) {
+							if (chunk.blocks.size() == chunk.offsets.back() || chunk.blocks.back().word != h / 64)
+								chunk.blocks.emplace_back(MaskBlock{h / 64, 0});
+							chunk.blocks.back().bits |= std::uint64_t(1) << (h % 64);
+						}
+						chunk.offsets.emplace_back(chunk.blocks.size());
+					}
+				}
+			});
+		};
+
+		// with opts.max_output the rows are built one wave of chunks at a
+		// time, so that the scan can stop before the rest are computed
+		size_t wave = opts.max_output ? nr_workers : nr_chunks;
+		auto &ret = ws.out;
+		size_t limit = opts.output_limit();
+		for (size_t c0 = 0, r = 0; c0 < nr_chunks && ret.size() < limit; c0 += wave) {
+			size_t c1 = std::min(c0 + wave, nr_chunks);
+			build_rows(c0, c1);
+			for (size_t c = c0; c < c1 && ret.size() < limit; c ++) {
+				auto &chunk = chunks[c];
+				for (size_t k = 0; k + 1 < chunk.offsets.size() && ret.size() < limit; k ++, r ++) {
+					if (removed[r / 64] >> (r % 64) & 1)
+						continue;
+					ret.emplace_back(polys[indices[r]]);
+					for (size_t b = chunk.offsets[k]; b < chunk.offsets[k + 1]; b ++)
+						removed[chunk.blocks[b].word] |= chunk.blocks[b].bits;
+				}
+			}
+		}
+		if (opts.stats) {
+			for (auto &&chunk: chunks) {
+				opts.stats->iou_evals += chunk.iou_evals;
+				opts.stats->aabb_rejects += chunk.aabb_rejects;
+			}
+			opts.stats->kept += ret.size();
+			opts.stats->nms_suppress_ns += NmsStats::ns_since(start);
+		}
+		return ret;
+	}
+
+	/**
+	 * The standard NMS algorithm.
+	 *
+	 * Candidates are visited in descending score order; each keeper only
+	 * compares against the survivors found through a PolyGrid, since
+	 * polygons with disjoint bounding boxes have an IoU of zero.
+	 *
+	 * Candidates under opts.min_score could only ever suppress each other,
+	 * so they are erased from `polys` before the grid is built; the loop
+	 * ends after opts.max_output keepers.
+	 *
+	 * Returns ws.out, so `polys` may be ws.polys but not ws.out.
+	 */
+	template<typename IoU>
+	std::vector<Polygon> &standard_nms(std::vector<Polygon> &polys, float iou_threshold,
+			const HardSuppression &, const NmsOptions &opts, Workspace &ws) {
+		trace::Span span("standard_nms");
+		polys.erase(std::remove_if(polys.begin(), polys.end(),
+					[&](const Polygon &p) { return p.score < opts.min_score; }), polys.end());
+		if (opts.mode == NMS_BITMASK)
+			return bitmask_nms<IoU>(polys, iou_threshold, opts, ws);
+
+		size_t n = polys.size();
+		auto &ret = ws.out;
+		ret.clear();
+		if (n == 0)
+			return ret;
+		auto start = opts.stats ? NmsStats::Clock::now() : NmsStats::Clock::time_point();
+		auto &indices = ws.indices, &rank = ws.rank;
+		score_order(polys, indices);
+		rank.resize(n);
+		for (size_t r = 0; r < n; r ++)
+			rank[indices[r]] = r;
+
+		// with a negative threshold even disjoint polygons are merged
+		auto &grid = ws.grid;
+		grid.assign(polys, iou_threshold < 0);
+		auto &scorer = ws.scorer<IoU>();
+		scorer.assign(polys);
+		auto &suppressed = ws.flags;
+		suppressed.assign(n, false);
+		if (opts.stats) {
+			opts.stats->nms_setup_ns += NmsStats::ns_since(start);
+			start = NmsStats::Clock::now();
+		}
+
+		// gather the survivors around each keeper, then score them against
+		// it in one batch
+		auto &cand = ws.cand;
+		auto &ious = ws.ious;
+		size_t limit = opts.output_limit();
+		size_t iou_evals = 0, aabb_rejects = 0;
+		for (size_t r = 0; r < n; r ++) {
+			size_t cur = indices[r];
+			if (suppressed[cur])
+				continue;
+			ret.emplace_back(polys[cur]);
+			if (ret.size() == limit)
+				break;
+			cand.clear();
+			aabb_rejects += grid.visit(cur, [&](size_t j) {
+				if (rank[j] > r && !suppressed[j])
+					cand.emplace_back(std::int32_t(j));
+			});
+			iou_evals += cand.size();
+			ious.resize(cand.size());
+			scorer.iou(cur, cand.data(), cand.size(), ious.data());
+			for (size_t c = 0; c < cand.size(); c ++)
+				if (ious[c] > iou_threshold)
+					suppressed[cand[c]] = true;
+		}
+		if (opts.stats) {
+			opts.stats->iou_evals += iou_evals;
+			opts.stats->aabb_rejects += aabb_rejects;
+			opts.stats->kept += ret.size();
+			opts.stats->nms_suppress_ns += NmsStats::ns_since(start);
+		}
+		return ret;
+	}
+
+	/**
+	 * Soft NMS: the best remaining candidate is kept, and the scores of the
+	 * candidates around it decay according to `suppression`. Returns the
+	 * candidates in keep order, with their decayed scores.
+	 *
+	 * The remaining candidates sit in a max-heap of scores; a decay pushes
+	 * the new score and leaves the old entry to be skipped when it comes
+	 * up. Only the neighbours found through a PolyGrid are decayed, and
+	 * candidates whose score drops below opts.min_score are discarded, so
+	 * the loop ends as soon as the best remaining score is under it, or
+	 * after opts.max_output keepers.
+	 */
+	template<typename IoU, typename Suppression>
+	std::vector<Polygon> &standard_nms(const std::vector<Polygon> &polys, float iou_threshold,
+			const Suppression &suppression, const NmsOptions &opts, Workspace &ws) {
+		static_assert(Suppression::soft,
+				"hard suppression filters the candidates in place, so it takes them by non-const reference");
+		trace::Span span("standard_nms");
+		auto start = opts.stats ? NmsStats::Clock::now() : NmsStats::Clock::time_point();
+		size_t n = polys.size();
+		auto &grid = ws.grid;
+		grid.assign(polys, iou_threshold < 0);
+		auto &scorer = ws.scorer<IoU>();
+		scorer.assign(polys);
+		auto &scores = ws.scores;
+		scores.resize(n);
+		// kept, or decayed below the floor
+		auto &done = ws.flags;
+		done.assign(n, false);
+
+		// highest score first, lowest index among equal scores
+		typedef std::pair<float, size_t> Entry;
+		auto lower = [](const Entry &a, const Entry &b) {
+			return a.first < b.first || (a.first == b.first && a.second > b.second);
+		};
+		auto &heap = ws.heap;
+		heap.clear();
+		for (size_t i = 0; i < n; i ++) {
+			scores[i] = polys[i].score;
+			if (scores[i] >= opts.min_score)
+				heap.emplace_back(scores[i], i);
+		}
+		std::make_heap(heap.begin(), heap.end(), lower);
+		if (opts.stats) {
+			opts.stats->nms_setup_ns += NmsStats::ns_since(start);
+			start = NmsStats::Clock::now();
+		}
+
+		auto &ret = ws.out;
+		ret.clear();
+		auto &cand = ws.cand;
+		auto &ious = ws.ious;
+		size_t limit = opts.output_limit();
+		size_t iou_evals = 0, aabb_rejects = 0;
+		while (heap.size() && ret.size() < limit) {
+			std::pop_heap(heap.begin(), heap.end(), lower);
+			auto top = heap.back();
+			heap.pop_back();
+			size_t cur = top.second;
+			if (done[cur] || top.first != scores[cur])
+				continue;
+			done[cur] = true;
+			ret.emplace_back(polys[cur]);
+			ret.back().score = scores[cur];
+
+			cand.clear();
+			aabb_rejects += grid.visit(cur, [&](size_t j) {
+				if (!done[j])
+					cand.emplace_back(std::int32_t(j));
+			});
+			iou_evals += cand.size();
+			ious.resize(cand.size());
+			scorer.iou(cur, cand.data(), cand.size(), ious.data());
+			for (size_t c = 0; c < cand.size(); c ++) {
+				size_t j = cand[c];
+				auto score = scores[j] * suppression.decay(ious[c], iou_threshold);
+				if (score == scores[j])
+					continue;
+				scores[j] = score;
+				if (score >= opts.min_score) {
+					heap.emplace_back(score, j);
+					std::push_heap(heap.begin(), heap.end(), lower);
+				} else {
+					done[j] = true;
+				}
+			}
+		}
+		if (opts.stats) {
+			opts.stats->iou_evals += iou_evals;
+			opts.stats->aabb_rejects += aabb_rejects;
+			opts.stats->kept += ret.size();
+			opts.stats->nms_suppress_ns += NmsStats::ns_since(start);
+		}
+		return ret;
+	}
+
+	template<typename IoU, typename Suppression>
+	std::vector<Polygon> standard_nms(const std::vector<Polygon> &polys, float iou_threshold,
+			const Suppression &suppression, const NmsOptions &opts) {
+		Workspace ws;
+		ws.polys = polys;
+		return std::move(standard_nms<IoU>(ws.polys, iou_threshold, suppression, opts, ws));
+	}
+
+	std::vector<Polygon> standard_nms(std::vector<Polygon> &polys, float iou_threshold,
+			const NmsOptions &opts = NmsOptions()) {
+		if (opts.kernel == IOU_CONVEX_QUAD)
+			return standard_nms<ConvexQuadIoU>(polys, iou_threshold, HardSuppression(), opts);
+		return standard_nms<ClipperIoU>(polys, iou_threshold, HardSuppression(), opts);
+	}
+
+	/**
+	 * One step of the locality-aware first pass: merge `poly` into the
+	 * last polygon if they overlap enough, otherwise start a new one.
+	 */
+	template<typename IoU, typename Merge>
+	void locality_merge(std::vector<Polygon> &polys, const Polygon &poly, float iou_threshold) {
+		if (polys.size() && should_merge<IoU>(poly, polys.back(), iou_threshold)) {
+			// merge with the last one
+			polys.back() = Merge::merge(polys.back(), poly);
+		} else {
+			polys.emplace_back(poly);
+		}
+	}
+
+	void locality_merge(std::vector<Polygon> &polys, const Polygon &poly, float iou_threshold,
+			IoUKernel kernel) {
+		if (kernel == IOU_CONVEX_QUAD)
+			locality_merge<ConvexQuadIoU, WeightedMerge>(polys, poly, iou_threshold);
+		else
+			locality_merge<ClipperIoU, WeightedMerge>(polys, poly, iou_threshold);
+	}
+
+	/**
+	 * Two-dimensional variant of the locality-aware first pass.
+	 *
+	 * Besides the group the previous candidate went into (the horizontal
+	 * neighbour, as in locality_merge), a candidate may join any open
+	 * group of the rows above it whose bounding box overlaps its own, so
+	 * one text line ends up as one group instead of one per score map
+	 * row. Open groups are kept sorted by their left edge, and are closed
+	 * once a candidate starts below their bounding box.
+	 *
+	 * The groups are built in ws.polys, with ws.boxes and ws.active as
+	 * scratch.
+	 */
+	template<typename IoU, typename Merge>
+	class GroupMerger {
+		public:
+			GroupMerger(float iou_threshold, Workspace &ws):
+				iou_evals(0), aabb_rejects(0),
+				iou_threshold(iou_threshold), polys(ws.polys), boxes(ws.boxes), active(ws.active),
+				last(0), sweep_y(std::numeric_limits<float>::max()) {
+				polys.clear();
+				boxes.clear();
+				active.clear();
+			}
+
+			/**
+			 * Add the next candidate, in y order.
+			 */
+			void add(const Polygon &poly) {
+				AABB box(poly.poly);
+				if (active.size() && box.y0 > sweep_y)
+					sweep(box.y0);
+
+				iou_evals += polys.size() > 0;
+				if (polys.size() && should_merge<IoU>(poly, polys[last], iou_threshold)) {
+					merge(last, poly);
+					return;
+				}
+				for (size_t k = 0; k < active.size(); k ++) {
+					size_t g = active[k];
+					auto &gbox = boxes[g];
+					if (gbox.x0 > box.x1)
+						break;
+					if (g == last)
+						continue;
+					if (!gbox.overlaps(box)) {
+						aabb_rejects ++;
+						continue;
+					}
+					iou_evals ++;
+					if (should_merge<IoU>(poly, polys[g], iou_threshold)) {
+						merge(g, poly);
+						last = g;
+						return;
+					}
+				}
+
+				last = polys.size();
+				polys.emplace_back(poly);
+				boxes.emplace_back(box);
+				active.emplace_back(last);
+				place(active.size() - 1);
+				sweep_y = std::min(sweep_y, box.y1);
+			}
+
+			std::vector<Polygon> &get() {
+				return polys;
+			}
+
+			// for NmsStats
+			size_t iou_evals, aabb_rejects;
+
+		private:
+			void merge(size_t g, const Polygon &poly) {
+				polys[g] = Merge::merge(polys[g], poly);
+				boxes[g] = AABB(polys[g].poly);
+
+				auto it = std::find(active.begin(), active.end(), g);
+				if (it != active.end())
+					place(it - active.begin());
+			}
+
+			// restore the x order of active after element k moved
+			void place(size_t k) {
+				while (k > 0 && boxes[active[k - 1]].x0 > boxes[active[k]].x0) {
+					std::swap(active[k - 1], active[k]);
+					k --;
+				}
+				while (k + 1 < active.size() && boxes[active[k + 1]].x0 < boxes[active[k]].x0) {
+					std::swap(active[k + 1], active[k]);
+					k ++;
+				}
+			}
+
+			// close the groups lying entirely above y
+			void sweep(float y) {
+				sweep_y = std::numeric_limits<float>::max();
+				size_t m = 0;
+				for (auto &&g: active) {
+					if (boxes[g].y1 < y)
+						continue;
+					active[m ++] = g;
+					sweep_y = std::min(sweep_y, boxes[g].y1);
+				}
+				active.resize(m);
+			}
+
+			float iou_threshold;
+			std::vector<Polygon> &polys;
+			std::vector<AABB> &boxes;
+			// open groups, by ascending boxes[g].x0
+			std::vector<size_t> &active;
+			// group of the previous candidate
+			size_t last;
+			// no open group can be closed before a candidate starts below this
+			float sweep_y;
+	};
+
+	/**
+	 * The locality-aware first pass over candidates that arrive in y order.
+	 *
+	 * `for_unit(u, emit)` calls `emit(key, poly)` for every candidate of
+	 * unit u < n (one input quadrangle, or one score map row), with keys
+	 * increasing along the scan. It is a functor with a call operator
+	 * templated on the emitter, such as QuadUnits, so that the per-candidate
+	 * merge inlines into the scan.
+	 *
+	 * With opts.parallel_locality the units are cut into stripes of at
+	 * least `min_stripe` units that are merged independently on the
+	 * ThreadPool. Each seam is then re-merged serially onto the result of
+	 * the stripes above it until a group starts at the same candidate as
+	 * in the stripe's own run; from there on both runs agree, so the
+	 * result is identical to the serial pass.
+	 *
+	 * With opts.locality_2d candidates are grouped by a GroupMerger, which
+	 * always runs serially.
+	 *
+	 * The merged polygons are left in ws.polys.
+	 */
+	template<typename IoU, typename Merge, typename F>
+	std::vector<Polygon> &locality_pass(size_t n, size_t min_stripe, F &&for_unit, float iou_threshold,
+			const NmsOptions &opts, Workspace &ws) {
+		trace::Span span("locality_pass");
+		auto &polys = ws.polys;
+		auto start = opts.stats ? NmsStats::Clock::now() : NmsStats::Clock::time_point();
+		size_t input = 0, iou_evals = 0, aabb_rejects = 0;
+		auto done = [&]() -> std::vector<Polygon> & {
+			if (opts.stats) {
+				auto &stats = *opts.stats;
+				stats.input += input;
+				stats.after_locality += polys.size();
+				stats.merges += input - polys.size();
+				stats.iou_evals += iou_evals;
+				stats.aabb_rejects += aabb_rejects;
+				stats.locality_ns += NmsStats::ns_since(start);
+			}
+			return polys;
+		};
+
+		if (opts.locality_2d) {
+			GroupMerger<IoU, Merge> merger(iou_threshold, ws);
+			auto emit = [&](size_t, const Polygon &poly) {
+				input ++;
+				merger.add(poly);
+			};
+			for (size_t u = 0; u < n; u ++)
+				for_unit(u, emit);
+			iou_evals = merger.iou_evals;
+			aabb_rejects = merger.aabb_rejects;
+			return done();
+		}
+
+		polys.clear();
+		size_t num_threads = opts.num_threads ? opts.num_threads : std::max(1u, std::thread::hardware_concurrency());
+		size_t nr_stripes = opts.parallel_locality ? std::min(num_threads * 4, n / std::max<size_t>(min_stripe, 1)) : 1;
+		if (nr_stripes <= 1) {
+			auto emit = [&](size_t, const Polygon &poly) {
+				input ++;
+				locality_merge<IoU, Merge>(polys, poly, iou_threshold);
+			};
+			for (size_t u = 0; u < n; u ++)
+				for_unit(u, emit);
+			// every candidate but the first is compared with the last group
+			iou_evals = input ? input - 1 : 0;
+			return done();
+		}
+
+		auto &stripes = ws.stripes;
+		if (stripes.size() < nr_stripes)
+			stripes.resize(nr_stripes);
+		ThreadPool::instance().run(nr_stripes, num_threads, [&](size_t s) {
+			trace::Span span("locality_pass/stripe");
+			auto &stripe = stripes[s];
+			stripe.polys.clear();
+			stripe.starts.clear();
+			stripe.input = 0;
+			auto emit = [&](size_t key, const Polygon &poly) {
+				size_t k = stripe.polys.size();
+				stripe.input ++;
+				locality_merge<IoU, Merge>(stripe.polys, poly, iou_threshold);
+				if (stripe.polys.size() != k)
+					stripe.starts.emplace_back(key);
+			};
+			for (size_t u = n * s / nr_stripes; u < n * (s + 1) / nr_stripes; u ++)
+				for_unit(u, emit);
+		});
+
+		// swapped rather than moved, so both buffers stay in the workspace
+		polys.swap(stripes[0].polys);
+		for (size_t s = 0; s < nr_stripes; s ++)
+			input += stripes[s].input;
+		// the seams redo comparisons the stripes already made; count each
+		// candidate once, as the serial pass does
+		iou_evals = input ? input - 1 : 0;
+		for (size_t s = 1; s < nr_stripes; s ++) {
+			auto &stripe = stripes[s];
+			size_t g = 0;
+			bool synced = false;
+			auto emit = [&](size_t key, const Polygon &poly) {
+				if (synced)
+					return;
+				while (g < stripe.starts.size() && stripe.starts[g] < key)
+					g ++;
+				size_t k = polys.size();
+				locality_merge<IoU, Merge>(polys, poly, iou_threshold);
+				if (polys.size() != k && g < stripe.starts.size() && stripe.starts[g] == key) {
+					// same state as the stripe's own run: take the rest from it
+					polys.pop_back();
+					polys.insert(polys.end(), stripe.polys.begin() + g, stripe.polys.end());
+					synced = true;
+				}
+			};
+			for (size_t u = n * s / nr_stripes; u < n * (s + 1) / nr_stripes && !synced; u ++)
+				for_unit(u, emit);
+		}
+		return done();
+	}
+
+	/**
+	 * Units of locality_pass: the quadrangles of an n-by-9 array, or only
+	 * its rows listed in `rows`, one per unit.
+	 */
+	struct QuadUnits {
+		const float *data;
+		// rows of data by unit, or nullptr for unit u being row u
+		const size_t *rows;
+
+		template<typename Emit>
+		void operator()(size_t u, Emit &emit) const {
+			auto p = data + (rows ? rows[u] : u) * 9;
+			Polygon poly{
+				make_quad(p[0], p[1], p[2], p[3], p[4], p[5], p[6], p[7]),
+				p[8],
+			};
+			emit(u, poly);
+		}
+	};
+
+	/**
+	 * Locality-aware NMS with a fixed IoU, merge and suppression policy;
+	 * every combination is compiled on its own, without any dispatch in
+	 * the inner loops. opts.kernel is not used.
+	 *
+	 * Returns ws.out, which stays valid until the workspace is used again.
+	 */
+	template<typename IoU, typename Merge, typename Suppression>
+	std::vector<Polygon> &
+		merge_quadrangle_n9(const float *data, size_t n, float iou_threshold,
+				const Suppression &suppression, const NmsOptions &opts, Workspace &ws) {
+			trace::Span span("merge_quadrangle_n9");
+			// first pass
+			auto &polys = locality_pass<IoU, Merge>(n, 4096, QuadUnits{data, nullptr}, iou_threshold, opts, ws);
+			return standard_nms<IoU>(polys, iou_threshold, suppression, opts, ws);
+		}
+
+	template<typename IoU, typename Merge, typename Suppression>
+	std::vector<Polygon>
+		merge_quadrangle_n9(const float *data, size_t n, float iou_threshold,
+				const Suppression &suppression, const NmsOptions &opts) {
+			Workspace ws;
+			return std::move(merge_quadrangle_n9<IoU, Merge>(data, n, iou_threshold, suppression, opts, ws));
+		}
+
+	std::vector<Polygon> &
+		merge_quadrangle_n9(const float *data, size_t n, float iou_threshold,
+				const NmsOptions &opts, Workspace &ws) {
+			if (opts.kernel == IOU_CONVEX_QUAD)
+				return merge_quadrangle_n9<ConvexQuadIoU, WeightedMerge>(data, n, iou_threshold, HardSuppression(), opts, ws);
+			return merge_quadrangle_n9<ClipperIoU, WeightedMerge>(data, n, iou_threshold, HardSuppression(), opts, ws);
+		}
+
+	std::vector<Polygon>
+		merge_quadrangle_n9(const float *data, size_t n, float iou_threshold,
+				const NmsOptions &opts = NmsOptions()) {
+			Workspace ws;
+			return std::move(merge_quadrangle_n9(data, n, iou_threshold, opts, ws));
+		}
+
+	/**
+	 * Run merge_quadrangle_n9 on a batch of images, spread over the shared
+	 * ThreadPool.
+	 *
+	 * \param data the n[i]-by-9 quadrangles of image i
+	 */
+	std::vector<std::vector<Polygon>>
+		merge_quadrangle_n9_batch(const std::vector<const float *> &data, const std::vector<size_t> &n,
+				float iou_threshold, const NmsOptions &opts = NmsOptions(), size_t num_threads = 0) {
+			std::vector<std::vector<Polygon>> ret(data.size());
+			if (num_threads == 0)
+				num_threads = std::max(1u, std::thread::hardware_concurrency());
+			ThreadPool::instance().run(data.size(), num_threads, [&](size_t i) {
+				ret[i] = merge_quadrangle_n9(data[i], n[i], iou_threshold, opts);
+			});
+			return ret;
+		}
+
+	/**
+	 * Restore the RBOX quadrangle predicted at location (x, y) of the
+	 * input image, as icdar.restore_rectangle_rbox does.
+	 *
+	 * \param geo the 5 geometry channels: distances to the top, right,
+	 *		bottom and left edges, then the rotation angle
+	 * \param quad receives the 4 vertices, x and y interleaved
+	 */
+	void restore_rbox(double x, double y, const float *geo, double *quad) {
+		double d0 = geo[0], d1 = geo[1], d2 = geo[2], d3 = geo[3], angle = geo[4];
+		double h = d0 + d2, w = d1 + d3;
+
+		// box corners and the origin in a frame anchored at the corner the
+		// rotation pivots around
+		double px[4], py[4], ox, oy;
+		if (angle >= 0) {
+			double lx[4] = {0, w, w, 0}, ly[4] = {-h, -h, 0, 0};
+			std::copy(lx, lx + 4, px);
+			std::copy(ly, ly + 4, py);
+			ox = d3;
+			oy = -d2;
+		} else {
+			double lx[4] = {-w, 0, 0, -w}, ly[4] = {-h, -h, 0, 0};
+			std::copy(lx, lx + 4, px);
+			std::copy(ly, ly + 4, py);
+			ox = -d1;
+			oy = -d2;
+		}
+
+		double c = std::cos(angle), s = std::sin(angle);
+		for (size_t i = 0; i < 4; i ++) {
+			double dx = px[i] - ox, dy = py[i] - oy;
+			quad[i * 2] = c * dx + s * dy + x;
+			quad[i * 2 + 1] = -s * dx + c * dy + y;
+		}
+	}
+
+	/**
+	 * Units of locality_pass: the rows of a score map, each emitting the
+	 * RBOX quadrangles of its pixels above the threshold.
+	 */
+	struct RboxRowUnits {
+		const float *score, *geo;
+		size_t w;
+		float score_threshold, scale;
+
+		template<typename Emit>
+		void operator()(size_t y, Emit &emit) const {
+			double quad[8];
+			for (size_t x = 0; x < w; x ++) {
+				size_t i = y * w + x;
+				if (!(score[i] > score_threshold))
+					continue;
+				restore_rbox(double(x) * scale, double(y) * scale, geo + i * 5, quad);
+				Polygon poly{
+					make_quad(
+							float(quad[0]), float(quad[1]), float(quad[2]), float(quad[3]),
+							float(quad[4]), float(quad[5]), float(quad[6]), float(quad[7])),
+					score[i],
+				};
+				emit(i, poly);
+			}
+		}
+	};
+
+	/**
+	 * Fused EAST decoder: threshold the score map, restore the RBOX
+	 * geometry and run the locality-aware NMS in a single row-major pass,
+	 * so candidates reach the merger in y order without any intermediate
+	 * arrays.
+	 *
+	 * \param score an h-by-w score map
+	 * \param geo an h-by-w-by-5 RBOX geometry map
+	 * \param scale input image pixels per score map pixel
+	 */
+	template<typename IoU, typename Merge, typename Suppression>
+	std::vector<Polygon> &
+		merge_rbox_maps(const float *score, const float *geo, size_t h, size_t w,
+				float score_threshold, float iou_threshold, float scale,
+				const Suppression &suppression, const NmsOptions &opts, Workspace &ws) {
+			trace::Span span("merge_rbox_maps");
+			auto &polys = locality_pass<IoU, Merge>(h, 8, RboxRowUnits{score, geo, w, score_threshold, scale},
+					iou_threshold, opts, ws);
+			return standard_nms<IoU>(polys, iou_threshold, suppression, opts, ws);
+		}
+
+	template<typename IoU, typename Merge, typename Suppression>
+	std::vector<Polygon>
+		merge_rbox_maps(const float *score, const float *geo, size_t h, size_t w,
+				float score_threshold, float iou_threshold, float scale,
+				const Suppression &suppression, const NmsOptions &opts) {
+			Workspace ws;
+			return std::move(merge_rbox_maps<IoU, Merge>(score, geo, h, w,
+						score_threshold, iou_threshold, scale, suppression, opts, ws));
+		}
+
+	std::vector<Polygon> &
+		merge_rbox_maps(const float *score, const float *geo, size_t h, size_t w,
+				float score_threshold, float iou_threshold, float scale,
+				const NmsOptions &opts, Workspace &ws) {
+			if (opts.kernel == IOU_CONVEX_QUAD)
+				return merge_rbox_maps<ConvexQuadIoU, WeightedMerge>(score, geo, h, w,
+						score_threshold, iou_threshold, scale, HardSuppression(), opts, ws);
+			return merge_rbox_maps<ClipperIoU, WeightedMerge>(score, geo, h, w,
+					score_threshold, iou_threshold, scale, HardSuppression(), opts, ws);
+		}
+
+	std::vector<Polygon>
+		merge_rbox_maps(const float *score, const float *geo, size_t h, size_t w,
+				float score_threshold, float iou_threshold, float scale,
+				const NmsOptions &opts = NmsOptions()) {
+			Workspace ws;
+			return std::move(merge_rbox_maps(score, geo, h, w,
+						score_threshold, iou_threshold, scale, opts, ws));
+		}
+
+	/**
+	 * The candidates merge_rbox_maps feeds to its first pass: the restored
+	 * quadrangle of every score map pixel above score_threshold, in
+	 * row-major order, appended to `out` as n-by-9 floats.
+	 */
+	void restore_rbox_maps(const float *score, const float *geo, size_t h, size_t w,
+			float score_threshold, float scale, std::vector<float> &out) {
+		trace::Span span("restore_rbox_maps");
+		double quad[8];
+		for (size_t i = 0; i < h * w; i ++) {
+			if (!(score[i] > score_threshold))
+				continue;
+			restore_rbox(double(i % w) * scale, double(i / w) * scale, geo + i * 5, quad);
+			for (size_t k = 0; k < 8; k ++)
+				out.push_back(float(quad[k]));
+			out.push_back(score[i]);
+		}
+	}
+
+	/**
+	 * Stitch the merged quadrangles of overlapping tiles of one large image.
+	 *
+	 * Each tile went through NMS on its own, so duplicates can only be
+	 * pairs from different tiles, lying where tiles overlap. Quadrangles
+	 * whose bounding box stays clear of every other tile pass through
+	 * untouched; only the rest go through a hard NMS, and it only compares
+	 * quadrangles of different tiles.
+	 *
+	 * \param data the n[t]-by-9 quadrangles of tile t, in image coordinates
+	 * \param rects t-by-4 tile areas (x0, y0, x1, y1), in image coordinates
+	 *
+	 * \return the surviving quadrangles, in tile order
+	 */
+	template<typename IoU>
+	std::vector<Polygon> stitch_tiles(const std::vector<const float *> &data, const std::vector<size_t> &n,
+			const float *rects, float iou_threshold) {
+		size_t nr_tiles = data.size();
+		std::vector<AABB> areas;
+		for (size_t t = 0; t < nr_tiles; t ++)
+			areas.emplace_back(rects[t * 4], rects[t * 4 + 1], rects[t * 4 + 2], rects[t * 4 + 3]);
+
+		// every quadrangle, and the ones reaching into another tile
+		std::vector<Polygon> polys;
+		std::vector<size_t> band, owner;
+		for (size_t t = 0; t < nr_tiles; t ++) {
+			for (size_t i = 0; i < n[t]; i ++) {
+				auto p = data[t] + i * 9;
+				polys.emplace_back(Polygon{
+						make_quad(p[0], p[1], p[2], p[3], p[4], p[5], p[6], p[7]),
+						p[8],
+						});
+				AABB box(polys.back().poly);
+				for (size_t u = 0; u < nr_tiles; u ++) {
+					if (u != t && box.overlaps(areas[u])) {
+						band.emplace_back(polys.size() - 1);
+						owner.emplace_back(t);
+						break;
+					}
+				}
+			}
+		}
+
+		std::vector<Polygon> cands;
+		for (auto &&i: band)
+			cands.emplace_back(polys[i]);
+		size_t m = cands.size();
+		std::vector<size_t> indices;
+		score_order(cands, indices);
+		std::vector<size_t> rank(m);
+		for (size_t r = 0; r < m; r ++)
+			rank[indices[r]] = r;
+
+		PolyGrid grid(cands, iou_threshold < 0);
+		IoU scorer(cands);
+		std::vector<bool> suppressed(m, false);
+		std::vector<std::int32_t> cand;
+		std::vector<float> ious;
+		for (size_t r = 0; r < m; r ++) {
+			size_t cur = indices[r];
+			if (suppressed[cur])
+				continue;
+			cand.clear();
+			grid.visit(cur, [&](size_t j) {
+				if (rank[j] > r && !suppressed[j] && owner[j] != owner[cur])
+					cand.emplace_back(std::int32_t(j));
+			});
+			ious.resize(cand.size());
+			scorer.iou(cur, cand.data(), cand.size(), ious.data());
+			for (size_t c = 0; c < cand.size(); c ++)
+				if (ious[c] > iou_threshold)
+					suppressed[cand[c]] = true;
+		}
+
+		std::vector<Polygon> ret;
+		for (size_t i = 0, k = 0; i < polys.size(); i ++) {
+			if (k < m && band[k] == i) {
+				if (suppressed[k ++])
+					continue;
+			}
+			ret.emplace_back(polys[i]);
+		}
+		return ret;
+	}
+
+	std::vector<Polygon> stitch_tiles(const std::vector<const float *> &data, const std::vector<size_t> &n,
+			const float *rects, float iou_threshold, IoUKernel kernel = IOU_CLIPPER) {
+		if (kernel == IOU_CONVEX_QUAD)
+			return stitch_tiles<ConvexQuadIoU>(data, n, rects, iou_threshold);
+		return stitch_tiles<ClipperIoU>(data, n, rects, iou_threshold);
+	}
+
+	/**
+	 * merge_quadrangle_n9 over a stream of batches of quadrangles, for
+	 * inputs that arrive a band of rows at a time.
+	 *
+	 * Batches continue the y order of the previous ones, and the first
+	 * pass runs across them exactly as over one long input. Each push
+	 * states a frontier: no later quadrangle reaches above it. Groups that
+	 * overlap through their bounding boxes form components; the final NMS
+	 * of a component does not depend on anything outside it, so once a
+	 * component lies entirely above the frontier (and above the group the
+	 * next quadrangle may still merge into), it is final and emitted.
+	 * Everything emitted adds up to the result of merge_quadrangle_n9 on
+	 * the concatenated input, in score order within each emission.
+	 *
+	 * opts.max_output is not used.
+	 */
+	class IncrementalNMS {
+		public:
+			IncrementalNMS(float iou_threshold, const NmsOptions &opts = NmsOptions()):
+				iou_threshold(iou_threshold), opts(opts),
+				frontier(-std::numeric_limits<float>::infinity()) {
+				this->opts.max_output = 0;
+			}
+
+			/**
+			 * Add the next n-by-9 quadrangles and return the polygons that
+			 * became final; the result stays valid until the next call.
+			 *
+			 * \param frontier no later quadrangle reaches above this y
+			 */
+			std::vector<Polygon> &push(const float *data, size_t n, float frontier) {
+				for (size_t i = 0; i < n; i ++) {
+					auto p = data + i * 9;
+					Polygon poly{
+						make_quad(p[0], p[1], p[2], p[3], p[4], p[5], p[6], p[7]),
+						p[8],
+					};
+					locality_merge(pending, poly, iou_threshold, opts.kernel);
+				}
+				return advance(frontier);
+			}
+
+			/**
+			 * Decode and add rows [row0, row0 + h) of an EAST score map, as
+			 * merge_rbox_maps does.
+			 *
+			 * \param score the h-by-w score map rows
+			 * \param geo the matching h-by-w-by-5 RBOX geometry rows
+			 */
+			std::vector<Polygon> &push_rbox_rows(const float *score, const float *geo, size_t row0, size_t h, size_t w,
+					float score_threshold, float scale, float frontier) {
+				double quad[8];
+				for (size_t i = 0; i < h * w; i ++) {
+					if (!(score[i] > score_threshold))
+						continue;
+					restore_rbox(double(i % w) * scale, double(row0 + i / w) * scale, geo + i * 5, quad);
+					Polygon poly{
+						make_quad(
+								float(quad[0]), float(quad[1]), float(quad[2]), float(quad[3]),
+								float(quad[4]), float(quad[5]), float(quad[6]), float(quad[7])),
+						score[i],
+					};
+					locality_merge(pending, poly, iou_threshold, opts.kernel);
+				}
+				return advance(frontier);
+			}
+
+			/**
+			 * End of input: return every polygon not emitted yet.
+			 */
+			std::vector<Polygon> &finish() {
+				ready.swap(pending);
+				pending.clear();
+				frontier = -std::numeric_limits<float>::infinity();
+				return suppress();
+			}
+
+		private:
+			std::vector<Polygon> &advance(float frontier_) {
+				frontier = std::max(frontier, frontier_);
+				ready.clear();
+				size_t n = pending.size();
+				if (n == 0)
+					return suppress();
+
+				// union the groups whose bounding boxes overlap
+				auto &grid = ws.grid;
+				grid.assign(pending, iou_threshold < 0);
+				parent.resize(n);
+				std::iota(parent.begin(), parent.end(), 0);
+				for (size_t i = 0; i < n; i ++)
+					grid.visit(i, [&](size_t j) {
+						parent[find(i)] = find(j);
+					});
+
+				// the group the next quadrangle may merge into only grows
+				// towards the frontier
+				float limit = std::min(frontier, AABB(pending.back().poly).y0);
+				bottom.assign(n, -std::numeric_limits<float>::infinity());
+				for (size_t i = 0; i < n; i ++) {
+					auto &b = bottom[find(i)];
+					b = std::max(b, AABB(pending[i].poly).y1);
+				}
+				bottom[find(n - 1)] = std::numeric_limits<float>::infinity();
+
+				size_t m = 0;
+				for (size_t i = 0; i < n; i ++) {
+					if (bottom[find(i)] < limit)
+						ready.emplace_back(pending[i]);
+					else
+						pending[m ++] = pending[i];
+				}
+				pending.resize(m);
+				return suppress();
+			}
+
+			std::vector<Polygon> &suppress() {
+				if (opts.kernel == IOU_CONVEX_QUAD)
+					return standard_nms<ConvexQuadIoU>(ready, iou_threshold, HardSuppression(), opts, ws);
+				return standard_nms<ClipperIoU>(ready, iou_threshold, HardSuppression(), opts, ws);
+			}
+
+			size_t find(size_t i) {
+				while (parent[i] != i)
+					i = parent[i] = parent[parent[i]];
+				return i;
+			}
+
+			float iou_threshold;
+			NmsOptions opts;
+			float frontier;
+			// groups of the first pass not emitted yet, in y order
+			std::vector<Polygon> pending;
+			// groups of the components that became final
+			std::vector<Polygon> ready;
+			std::vector<size_t> parent;
+			// lowest bounding box edge of each component
+			std::vector<float> bottom;
+			Workspace ws;
+	};
+
+	/**
+	 * A text region followed over the frames of a video.
+	 */
+	struct Track {
+		size_t id;
+		// smoothed geometry and score
+		Polygon poly;
+		// frames the track was seen in
+		size_t hits;
+		// consecutive frames without a match
+		size_t missed;
+	};
+
+	/**
+	 * merge_quadrangle_n9 for video streams, where most text stays still
+	 * between frames.
+	 *
+	 * The kept quadrangles of the previous frames are tracks, held in a
+	 * PolyGrid. Each candidate of a new frame is matched against them by
+	 * the IoU of their bounding boxes, which is cheap and enough to
+	 * recognise a region that did not move; the candidates of a track are
+	 * merged into its observation of this frame (weighted vertices, the
+	 * best score), so stable regions skip both the locality-aware pass and
+	 * the final NMS. Only the unmatched candidates go through them, with
+	 * the observations kept first; the survivors start new tracks.
+	 *
+	 * Matched tracks move towards their observation by an exponential
+	 * moving average, which removes the frame to frame jitter of the
+	 * geometry. Tracks are dropped after more than max_missed frames
+	 * without a match.
+	 */
+	class TemporalNMS {
+		public:
+			/**
+			 * \param match_threshold a candidate continues a track if the IoU
+			 *		of their bounding boxes is above this threshold
+			 * \param smoothing the weight of the previous geometry and score
+			 *		in the moving average; 0 follows the observations as is
+			 */
+			TemporalNMS(float iou_threshold, float match_threshold = 0.5f, float smoothing = 0.5f,
+					size_t max_missed = 0, const NmsOptions &opts = NmsOptions()):
+				iou_threshold(iou_threshold), match_threshold(match_threshold), smoothing(smoothing),
+				max_missed(max_missed), opts(opts), next_id(0) {}
+
+			/**
+			 * Process the n-by-9 quadrangles of the next frame, sorted by y,
+			 * and return the tracks seen in it; the result stays valid until
+			 * the next call. With opts.max_output only that many tracks are
+			 * returned, the highest scoring first; the others are still
+			 * followed.
+			 */
+			std::vector<Track> &update(const float *data, size_t n) {
+				if (opts.kernel == IOU_CONVEX_QUAD)
+					step<ConvexQuadIoU>(data, n);
+				else
+					step<ClipperIoU>(data, n);
+
+				out.clear();
+				for (auto &&t: tracks)
+					if (t.missed == 0)
+						out.emplace_back(t);
+				if (out.size() > opts.output_limit()) {
+					std::partial_sort(out.begin(), out.begin() + opts.max_output, out.end(),
+							[](const Track &a, const Track &b) {
+								return a.poly.score > b.poly.score || (a.poly.score == b.poly.score && a.id < b.id);
+							});
+					out.resize(opts.max_output);
+				}
+				return out;
+			}
+
+			/**
+			 * Forget every track, e.g. after a scene cut.
+			 */
+			void reset() {
+				tracks.clear();
+			}
+
+		private:
+			template<typename IoU>
+			void step(const float *data, size_t n) {
+				// match the candidates against the tracks
+				size_t nr_tracks = tracks.size();
+				all.clear();
+				for (auto &&t: tracks)
+					all.emplace_back(t.poly);
+				track_grid.assign(all);
+				stamp.assign(nr_tracks, std::numeric_limits<size_t>::max());
+				mergers.assign(nr_tracks, PolyMerger());
+				best_score.assign(nr_tracks, -std::numeric_limits<float>::infinity());
+				unmatched.clear();
+				for (size_t i = 0; i < n; i ++) {
+					auto p = data + i * 9;
+					Polygon poly{
+						make_quad(p[0], p[1], p[2], p[3], p[4], p[5], p[6], p[7]),
+						p[8],
+					};
+					AABB box(poly.poly);
+					size_t best = nr_tracks;
+					float best_iou = match_threshold;
+					track_grid.query(box, i, stamp, [&](size_t j) {
+						auto iou = box_iou(box, AABB(all[j].poly));
+						if (iou > best_iou) {
+							best = j;
+							best_iou = iou;
+						}
+					});
+					if (best == nr_tracks) {
+						unmatched.emplace_back(i);
+						continue;
+					}
+					mergers[best].add(poly);
+					best_score[best] = std::max(best_score[best], poly.score);
+				}
+
+				// the observations, then the groups of the unmatched candidates
+				all.clear();
+				observation.assign(nr_tracks, 0);
+				for (size_t t = 0; t < nr_tracks; t ++) {
+					// no candidate, or none reaching the floor
+					if (best_score[t] == -std::numeric_limits<float>::infinity() || best_score[t] < opts.min_score)
+						continue;
+					observation[t] = all.size() + 1;
+					all.emplace_back(mergers[t].get());
+					all.back().score = best_score[t];
+				}
+				size_t nr_obs = all.size();
+				auto &groups = locality_pass<IoU, WeightedMerge>(unmatched.size(), 4096,
+						QuadUnits{data, unmatched.data()}, iou_threshold, opts, ws);
+				for (auto &&g: groups)
+					if (g.score >= opts.min_score)
+						all.emplace_back(g);
+				size_t m = all.size();
+
+				// the final NMS, for the groups only: observations are kept
+				// and go first
+				auto &grid = ws.grid;
+				grid.assign(all, iou_threshold < 0);
+				auto &scorer = ws.scorer<IoU>();
+				scorer.assign(all);
+				auto &suppressed = ws.flags;
+				suppressed.assign(m, false);
+				auto &indices = ws.indices;
+				score_order(all, indices);
+				auto &rank = ws.rank;
+				rank.assign(m, 0);
+				size_t r = 0;
+				for (auto &&i: indices)
+					if (i >= nr_obs)
+						rank[i] = ++ r;
+				auto &cand = ws.cand;
+				auto &ious = ws.ious;
+				auto suppress_around = [&](size_t cur) {
+					cand.clear();
+					grid.visit(cur, [&](size_t j) {
+						if (rank[j] > rank[cur] && !suppressed[j])
+							cand.emplace_back(std::int32_t(j));
+					});
+					ious.resize(cand.size());
+					scorer.iou(cur, cand.data(), cand.size(), ious.data());
+					for (size_t c = 0; c < cand.size(); c ++)
+						if (ious[c] > iou_threshold)
+							suppressed[cand[c]] = true;
+				};
+				for (size_t o = 0; o < nr_obs; o ++)
+					suppress_around(o);
+				for (auto &&i: indices)
+					if (i >= nr_obs && !suppressed[i])
+						suppress_around(i);
+
+				// move the tracks, then start the new ones
+				size_t k = 0;
+				for (size_t t = 0; t < nr_tracks; t ++) {
+					auto track = tracks[t];
+					if (observation[t]) {
+						smooth(track.poly, all[observation[t] - 1]);
+						track.hits ++;
+						track.missed = 0;
+					} else if (++ track.missed > max_missed) {
+						continue;
+					}
+					tracks[k ++] = track;
+				}
+				tracks.resize(k);
+				for (size_t g = nr_obs; g < m; g ++)
+					if (!suppressed[g])
+						tracks.emplace_back(Track{next_id ++, all[g], 1, 0});
+			}
+
+			static float box_iou(const AABB &a, const AABB &b) {
+				float w = std::min(a.x1, b.x1) - std::max(a.x0, b.x0), h = std::min(a.y1, b.y1) - std::max(a.y0, b.y0);
+				if (w <= 0 || h <= 0)
+					return 0;
+				float inter = w * h;
+				return inter / ((a.x1 - a.x0) * (a.y1 - a.y0) + (b.x1 - b.x0) * (b.y1 - b.y0) - inter);
+			}
+
+			void smooth(Polygon &poly, const Polygon &obs_given) const {
+				// match the vertex order first, as PolyMerger does
+				auto obs = PolyMerger().normalize_poly(poly, obs_given);
+				float a = smoothing, b = 1 - smoothing;
+				for (size_t k = 0; k < 4; k ++) {
+					poly.poly.x[k] = a * poly.poly.x[k] + b * obs.poly.x[k];
+					poly.poly.y[k] = a * poly.poly.y[k] + b * obs.poly.y[k];
+				}
+				poly.score = a * poly.score + b * obs.score;
+			}
+
+			float iou_threshold, match_threshold, smoothing;
+			size_t max_missed;
+			NmsOptions opts;
+			size_t next_id;
+			std::vector<Track> tracks, out;
+			// the tracks, then the observations and groups of the frame
+			std::vector<Polygon> all;
+			PolyGrid track_grid;
+			std::vector<size_t> stamp;
+			// candidates matched to each track
+			std::vector<PolyMerger> mergers;
+			std::vector<float> best_score;
+			// 1 + index of the observation of each track in all, 0 if none
+			std::vector<size_t> observation;
+			std::vector<size_t> unmatched;
+			Workspace ws;
+	};
+
+	/**
+	 * A rotated rectangle, as predicted by the RBOX geometry: centre,
+	 * width and height along its own axes, and the rotation angle used by
+	 * restore_rbox. Corners are centre + R * (+-w / 2, +-h / 2) with
+	 * R = [cos, sin; -sin, cos].
+	 */
+	struct RBox {
+		float cx, cy, w, h, angle;
+		float score;
+	};
+
+	namespace rotated {
+
+		/**
+		 * Counter-clockwise corners of a rotated rectangle, in the same
+		 * order as restore_rbox.
+		 */
+		inline void corners(const RBox &b, convex::Point *p) {
+			double c = std::cos(double(b.angle)), s = std::sin(double(b.angle));
+			double lx[4] = {-0.5 * b.w, 0.5 * b.w, 0.5 * b.w, -0.5 * b.w},
+				   ly[4] = {-0.5 * b.h, -0.5 * b.h, 0.5 * b.h, 0.5 * b.h};
+			for (size_t i = 0; i < 4; i ++)
+				p[i] = convex::Point{c * lx[i] + s * ly[i] + b.cx, -s * lx[i] + c * ly[i] + b.cy};
+		}
+
+		inline AABB bounds(const RBox &b) {
+			float c = std::abs(std::cos(b.angle)), s = std::abs(std::sin(b.angle));
+			float ex = 0.5f * (c * b.w + s * b.h), ey = 0.5f * (s * b.w + c * b.h);
+			return AABB(b.cx - ex, b.cy - ey, b.cx + ex, b.cy + ey);
+		}
+	}
+
+	/**
+	 * IoU of two rotated rectangles. Pairs whose bounding circles or
+	 * bounding boxes are disjoint are rejected before any clipping.
+	 */
+	float rbox_iou(const RBox &a, const RBox &b) {
+		if (!(a.w > 0 && a.h > 0 && b.w > 0 && b.h > 0))
+			return 0;
+		float dx = a.cx - b.cx, dy = a.cy - b.cy,
+			  r = 0.5f * (std::sqrt(a.w * a.w + a.h * a.h) + std::sqrt(b.w * b.w + b.h * b.h));
+		if (dx * dx + dy * dy > r * r)
+			return 0;
+		if (!rotated::bounds(a).overlaps(rotated::bounds(b)))
+			return 0;
+
+		convex::Point qa[4], qb[4];
+		rotated::corners(a, qa);
+		rotated::corners(b, qb);
+		double area_a = double(a.w) * a.h, area_b = double(b.w) * b.h;
+		auto inter_area = convex::intersection_area(qa, qb),
+			 uni_area = area_a + area_b - inter_area;
+		return uni_area > 0 ? float(inter_area / uni_area) : 0;
+	}
+
+	/**
+	 * Incrementally merge rotated rectangles by a score-weighted average of
+	 * their parameters.
+	 */
+	class RBoxMerger {
+		public:
+			RBoxMerger(): score(0), nr_boxes(0) {
+				memset(data, 0, sizeof(data));
+			}
+
+			void add(const RBox &b_given) {
+				auto b = nr_boxes > 0 ? normalize_rbox(get(), b_given) : b_given;
+				double s = b.score;
+				data[0] += b.cx * s;
+				data[1] += b.cy * s;
+				data[2] += b.w * s;
+				data[3] += b.h * s;
+				data[4] += b.angle * s;
+				score += s;
+				nr_boxes += 1;
+			}
+
+			/**
+			 * The same rectangle as `b`, described with the angle closest
+			 * to that of `ref`: a rectangle is unchanged by a half turn, and
+			 * by a quarter turn that swaps its width and height.
+			 */
+			static RBox normalize_rbox(const RBox &ref, const RBox &b) {
+				const double pi = 3.14159265358979323846;
+				RBox r = b;
+				double d = std::remainder(double(b.angle) - ref.angle, pi);
+				if (d > pi / 4) {
+					d -= pi / 2;
+					std::swap(r.w, r.h);
+				} else if (d < -pi / 4) {
+					d += pi / 2;
+					std::swap(r.w, r.h);
+				}
+				r.angle = float(ref.angle + d);
+				return r;
+			}
+
+			RBox get() const {
+				auto score_inv = 1.0 / std::max(1e-8, score);
+				assert(score > 0);
+				return RBox{
+					float(data[0] * score_inv), float(data[1] * score_inv),
+					float(data[2] * score_inv), float(data[3] * score_inv),
+					float(data[4] * score_inv), float(score)};
+			}
+
+		private:
+			double data[5];
+			double score;
+			std::int32_t nr_boxes;
+	};
+
+	/**
+	 * merge_quadrangle_n9 for rotated rectangles: a locality-aware pass
+	 * over the y-sorted boxes, then standard NMS over a grid of their
+	 * bounding boxes, all with rbox_iou.
+	 */
+	std::vector<RBox> merge_rboxes(std::vector<RBox> boxes, float iou_threshold) {
+		std::vector<RBox> groups;
+		for (auto &&b: boxes) {
+			if (groups.size() && rbox_iou(b, groups.back()) > iou_threshold) {
+				RBoxMerger merger;
+				merger.add(groups.back());
+				merger.add(b);
+				groups.back() = merger.get();
+			} else {
+				groups.emplace_back(b);
+			}
+		}
+
+		size_t n = groups.size();
+		std::vector<size_t> indices(n);
+		std::iota(std::begin(indices), std::end(indices), 0);
+		std::sort(std::begin(indices), std::end(indices), [&](size_t i, size_t j) { return groups[i].score > groups[j].score; });
+		std::vector<size_t> rank(n);
+		for (size_t r = 0; r < n; r ++)
+			rank[indices[r]] = r;
+
+		std::vector<AABB> bounds;
+		bounds.reserve(n);
+		for (auto &&b: groups)
+			bounds.emplace_back(rotated::bounds(b));
+		PolyGrid grid(std::move(bounds), iou_threshold < 0);
+		std::vector<bool> suppressed(n, false);
+		std::vector<RBox> ret;
+		for (size_t r = 0; r < n; r ++) {
+			size_t cur = indices[r];
+			if (suppressed[cur])
+				continue;
+			ret.emplace_back(groups[cur]);
+			grid.visit(cur, [&](size_t j) {
+				if (rank[j] > r && !suppressed[j] && rbox_iou(groups[cur], groups[j]) > iou_threshold)
+					suppressed[j] = true;
+			});
+		}
+		return ret;
+	}
+
+	/**
+	 * \param data n-by-6 rotated rectangles (cx, cy, w, h, angle, score),
+	 *		sorted by y
+	 */
+	std::vector<RBox> merge_rbox_n6(const float *data, size_t n, float iou_threshold) {
+		std::vector<RBox> boxes(n);
+		for (size_t i = 0; i < n; i ++) {
+			auto p = data + i * 6;
+			boxes[i] = RBox{p[0], p[1], p[2], p[3], p[4], p[5]};
+		}
+		return merge_rboxes(std::move(boxes), iou_threshold);
+	}
+
+	/**
+	 * The rotated rectangle predicted at location (x, y) of the input
+	 * image; its corners are the quadrangle of restore_rbox.
+	 */
+	RBox decode_rbox(double x, double y, const float *geo, float score) {
+		double quad[8];
+		restore_rbox(x, y, geo, quad);
+		return RBox{
+			float((quad[0] + quad[2] + quad[4] + quad[6]) / 4),
+			float((quad[1] + quad[3] + quad[5] + quad[7]) / 4),
+			geo[1] + geo[3], geo[0] + geo[2], geo[4], score};
+	}
+
+	/**
+	 * merge_rbox_maps, but keeping the geometry as rotated rectangles
+	 * throughout.
+	 */
+	std::vector<RBox> merge_rbox_maps_n6(const float *score, const float *geo, size_t h, size_t w,
+			float score_threshold, float iou_threshold, float scale) {
+		std::vector<RBox> boxes;
+		for (size_t y = 0; y < h; y ++)
+			for (size_t x = 0; x < w; x ++) {
+				size_t i = y * w + x;
+				if (score[i] > score_threshold)
+					boxes.emplace_back(decode_rbox(double(x) * scale, double(y) * scale, geo + i * 5, score[i]));
+			}
+		return merge_rboxes(std::move(boxes), iou_threshold);
+	}
+
+	namespace raster {
+
+		inline std::int64_t floor_div(std::int64_t a, std::int64_t b) {
+			auto q = a / b;
+			return (a % b != 0 && (a < 0) != (b < 0)) ? q - 1 : q;
+		}
+
+		/**
+		 * Clip the segment p1-p2 to a w-by-h image, as OpenCV's clipLine.
+		 * Returns false if nothing is left.
+		 */
+		inline bool clip_line(std::int64_t w, std::int64_t h,
+				std::int64_t &x1, std::int64_t &y1, std::int64_t &x2, std::int64_t &y2) {
+			std::int64_t right = w - 1, bottom = h - 1;
+			int c1 = (x1 < 0) + (x1 > right) * 2 + (y1 < 0) * 4 + (y1 > bottom) * 8;
+			int c2 = (x2 < 0) + (x2 > right) * 2 + (y2 < 0) * 4 + (y2 > bottom) * 8;
+			if ((c1 & c2) == 0 && (c1 | c2) != 0) {
+				std::int64_t a;
+				if (c1 & 12) {
+					a = c1 < 8 ? 0 : bottom;
+					x1 += std::int64_t(double(a - y1) * (x2 - x1) / (y2 - y1));
+					y1 = a;
+					c1 = (x1 < 0) + (x1 > right) * 2;
+				}
+				if (c2 & 12) {
+					a = c2 < 8 ? 0 : bottom;
+					x2 += std::int64_t(double(a - y2) * (x2 - x1) / (y2 - y1));
+					y2 = a;
+					c2 = (x2 < 0) + (x2 > right) * 2;
+				}
+				if ((c1 & c2) == 0 && (c1 | c2) != 0) {
+					if (c1) {
+						a = c1 == 1 ? 0 : right;
+						y1 += std::int64_t(double(a - x1) * (y2 - y1) / (x2 - x1));
+						x1 = a;
+						c1 = 0;
+					}
+					if (c2) {
+						a = c2 == 1 ? 0 : right;
+						y2 += std::int64_t(double(a - x2) * (y2 - y1) / (x2 - x1));
+						x2 = a;
+						c2 = 0;
+					}
+				}
+			}
+			return (c1 | c2) == 0;
+		}
+
+		/**
+		 * Call f(x, y) for every pixel of the 8-connected line p1-p2, with
+		 * the same pixel choices as OpenCV's line iterator.
+		 */
+		template<typename F>
+		void for_line(std::int64_t x1, std::int64_t y1, std::int64_t x2, std::int64_t y2, F &&f) {
+			if (x2 < x1) {
+				std::swap(x1, x2);
+				std::swap(y1, y2);
+			}
+			std::int64_t dx = x2 - x1, dy = y2 - y1, sy = dy < 0 ? -1 : 1;
+			dy = std::abs(dy);
+			bool steep = dy > dx;
+			if (steep)
+				std::swap(dx, dy);
+
+			std::int64_t err = dx - (dy + dy), plus = dx + dx, minus = -(dy + dy);
+			for (std::int64_t k = 0; k <= dx; k ++) {
+				f(x1, y1);
+				bool step = err < 0;
+				err += minus + (step ? plus : 0);
+				if (steep) {
+					y1 += sy;
+					x1 += step;
+				} else {
+					x1 += 1;
+					y1 += step ? sy : 0;
+				}
+			}
+		}
+
+		/**
+		 * Whether all vertices of the quadrangle q lie on the h-by-w map.
+		 */
+		inline bool quad_inside(const std::int64_t *q, std::int64_t h, std::int64_t w) {
+			for (size_t k = 0; k < 4; k ++)
+				if (q[k * 2] < 0 || q[k * 2] >= w || q[k * 2 + 1] < 0 || q[k * 2 + 1] >= h)
+					return false;
+			return true;
+		}
+
+		/**
+		 * Mean of the score map over the pixels cv2.fillPoly would paint for
+		 * the quadrangle q: the interior scanline spans plus the outline.
+		 * Works on one span per row (exact for convex quadrangles); `lo` and
+		 * `hi` are scratch rows of at least h entries.
+		 *
+		 * Exact only for quadrangles inside the map: OpenCV clips the
+		 * polygon edges to the image in a way that changed between
+		 * versions, and which this does not reproduce.
+		 */
+		inline double quad_mean(const std::int64_t *q, const float *score, std::int64_t h, std::int64_t w,
+				std::int64_t *lo, std::int64_t *hi) {
+			std::int64_t y0 = q[1], y1 = q[1];
+			for (size_t k = 1; k < 4; k ++) {
+				y0 = std::min(y0, q[k * 2 + 1]);
+				y1 = std::max(y1, q[k * 2 + 1]);
+			}
+			y0 = std::max<std::int64_t>(y0, 0);
+			y1 = std::min<std::int64_t>(y1, h - 1);
+			if (y0 > y1)
+				return 0;
+			for (auto y = y0; y <= y1; y ++) {
+				lo[y] = std::numeric_limits<std::int64_t>::max();
+				hi[y] = std::numeric_limits<std::int64_t>::min();
+			}
+
+			// interior: rows are half-open along each edge
+			for (size_t k = 0; k < 4; k ++) {
+				auto ax = q[k * 2], ay = q[k * 2 + 1],
+					 bx = q[(k + 1) % 4 * 2], by = q[(k + 1) % 4 * 2 + 1];
+				if (ay == by)
+					continue;
+				if (ay > by) {
+					std::swap(ax, bx);
+					std::swap(ay, by);
+				}
+				for (auto y = std::max(ay, y0); y < by && y <= y1; y ++) {
+					double x = ax + double(y - ay) * (bx - ax) / (by - ay);
+					lo[y] = std::min(lo[y], std::int64_t(std::ceil(x)));
+					hi[y] = std::max(hi[y], std::int64_t(std::floor(x)));
+				}
+			}
+
+			// outline
+			for (size_t k = 0; k < 4; k ++) {
+				auto ax = q[k * 2], ay = q[k * 2 + 1],
+					 bx = q[(k + 1) % 4 * 2], by = q[(k + 1) % 4 * 2 + 1];
+				if (!clip_line(w, h, ax, ay, bx, by))
+					continue;
+				for_line(ax, ay, bx, by, [&](std::int64_t x, std::int64_t y) {
+					lo[y] = std::min(lo[y], x);
+					hi[y] = std::max(hi[y], x);
+				});
+			}
+
+			double sum = 0;
+			std::int64_t count = 0;
+			for (auto y = y0; y <= y1; y ++) {
+				auto x0 = std::max<std::int64_t>(lo[y], 0), x1 = std::min<std::int64_t>(hi[y], w - 1);
+				auto row = score + y * w;
+				for (auto x = x0; x <= x1; x ++)
+					sum += row[x];
+				count += std::max<std::int64_t>(x1 - x0 + 1, 0);
+			}
+			return count ? sum / count : 0;
+		}
+	}
+
+	/**
+	 * Rescore boxes by the mean of the score map inside each of them,
+	 * matching cv2.fillPoly + cv2.mean on a full-size mask but visiting only
+	 * the rows each box covers. Boxes are processed in parallel; each thread
+	 * allocates its scratch rows once.
+	 *
+	 * \param boxes an n-by-9 array in input image coordinates; the last
+	 *		column is overwritten with the mean score
+	 * \param score an h-by-w score map
+	 * \param scale input image pixels per score map pixel
+	 * \param border if given, boxes crossing the border of the map keep
+	 *		their score and their indices are appended to it instead, for the
+	 *		caller to score with cv2; otherwise they get an approximation,
+	 *		see raster::quad_mean
+	 */
+	void rescore_quadrangle_n9(float *boxes, size_t n, const float *score, size_t h, size_t w,
+			int scale, size_t num_threads = 0, std::vector<size_t> *border = nullptr) {
+		trace::Span span("rescore_quadrangle_n9");
+		auto quantise = [&](const float *p, std::int64_t *q) {
+			for (size_t k = 0; k < 8; k ++)
+				q[k] = raster::floor_div(std::int64_t(p[k]), scale);
+		};
+		parallel_for(n, num_threads, [&](size_t begin, size_t end) {
+			std::vector<std::int64_t> lo(h), hi(h);
+			std::int64_t q[8];
+			for (size_t i = begin; i < end; i ++) {
+				auto p = boxes + i * 9;
+				quantise(p, q);
+				if (border && !raster::quad_inside(q, h, w))
+					continue;
+				p[8] = float(raster::quad_mean(q, score, h, w, lo.data(), hi.data()));
+			}
+		});
+		if (!border)
+			return;
+		std::int64_t q[8];
+		for (size_t i = 0; i < n; i ++) {
+			quantise(boxes + i * 9, q);
+			if (!raster::quad_inside(q, h, w))
+				border->emplace_back(i);
+		}
+	}
 }
\ No newline at end of file
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace lanms {
+
+	/**
+	 * Record files of post-processing inputs, written by lanms.RecordWriter
+	 * and read by the replay driver and the benchmarks.
+	 *
+	 * A file is the 8 byte magic "LNMSREC1" followed by frames, each a
+	 * RecordHeader and then, as little-endian float32, the h-by-w score
+	 * map, the h-by-w-by-5 geometry map and the n-by-9 pre-NMS boxes.
+	 */
+	namespace record {
+
+		const char MAGIC[8] = {'L', 'N', 'M', 'S', 'R', 'E', 'C', '1'};
+
+		struct RecordHeader {
+			std::uint32_t h, w;
+			// number of pre-NMS boxes
+			std::uint32_t n;
+			// input image pixels per score map pixel
+			float scale;
+			// the detect() arguments the frame was processed with
+			float score_map_thresh, nms_thres, box_thresh;
+		};
+		static_assert(sizeof(RecordHeader) == 28, "RecordHeader must not be padded");
+
+		struct Frame {
+			RecordHeader header;
+			std::vector<float> score, geo, boxes;
+		};
+
+		/**
+		 * Append the frames of the record file `path` to `frames`; false if
+		 * it cannot be read or is not a record file. A frame cut short at
+		 * the end, as left by a writer that was killed, is dropped.
+		 */
+		bool read_frames(const std::string &path, std::vector<Frame> &frames) {
+			FILE *f = std::fopen(path.c_str(), "rb");
+			if (!f)
+				return false;
+			char magic[sizeof(MAGIC)];
+			bool ok = std::fread(magic, 1, sizeof(magic), f) == sizeof(magic) &&
+				std::memcmp(magic, MAGIC, sizeof(MAGIC)) == 0;
+			Frame frame;
+			while (ok && std::fread(&frame.header, sizeof(RecordHeader), 1, f) == 1) {
+				auto &hd = frame.header;
+				frame.score.resize(size_t(hd.h) * hd.w);
+				frame.geo.resize(size_t(hd.h) * hd.w * 5);
+				frame.boxes.resize(size_t(hd.n) * 9);
+				if (std::fread(frame.score.data(), sizeof(float), frame.score.size(), f) != frame.score.size() ||
+						std::fread(frame.geo.data(), sizeof(float), frame.geo.size(), f) != frame.geo.size() ||
+						std::fread(frame.boxes.data(), sizeof(float), frame.boxes.size(), f) != frame.boxes.size())
+					break;
+				frames.push_back(std::move(frame));
+			}
+			std::fclose(f);
+			return ok;
+		}
+
+		/**
+		 * Whether `path` starts with the record file magic.
+		 */
+		bool is_record_file(const std::string &path) {
+			FILE *f = std::fopen(path.c_str(), "rb");
+			if (!f)
+				return false;
+			char magic[sizeof(MAGIC)];
+			bool ret = std::fread(magic, 1, sizeof(magic), f) == sizeof(magic) &&
+				std::memcmp(magic, MAGIC, sizeof(MAGIC)) == 0;
+			std::fclose(f);
+			return ret;
+		}
+	}
+}
@@ -0,0 +1,150 @@
+/**
+ * Replay recorded post-processing inputs through the lanms decode, NMS
+ * and rescoring path, and report per-stage latency percentiles.
+ *
+ *	make replay && ./replay [-k clipper|convex_quad] [-p passes] record.bin ...
+ *
+ * Record files are written by lanms.RecordWriter, e.g. with the
+ * --record_path flag of eval.py and run_demo_server.py. Every frame is
+ * processed with the thresholds it was recorded with.
+ */
+#include "lanms.h"
+#include "record.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace lanms_replay {
+
+	using Clock = std::chrono::steady_clock;
+
+	/**
+	 * Latencies of one stage, in seconds.
+	 */
+	struct Stage {
+		const char *name;
+		std::vector<double> samples;
+
+		template<typename F>
+		void time(F &&f) {
+			auto start = Clock::now();
+			f();
+			samples.push_back(std::chrono::duration<double>(Clock::now() - start).count());
+		}
+
+		double percentile(double p) const {
+			auto sorted = samples;
+			std::sort(sorted.begin(), sorted.end());
+			size_t i = std::min(sorted.size() - 1, size_t(p / 100 * sorted.size()));
+			return sorted[i];
+		}
+
+		void print() const {
+			if (samples.empty())
+				return;
+			double sum = 0;
+			for (double s: samples)
+				sum += s;
+			std::printf("%-10s %9.3f %9.3f %9.3f %9.3f %9.3f\n", name,
+					sum / samples.size() * 1e3, percentile(50) * 1e3, percentile(90) * 1e3,
+					percentile(99) * 1e3, percentile(100) * 1e3);
+		}
+	};
+}
+
+int main(int argc, char **argv) {
+	using namespace lanms_replay;
+	lanms::NmsOptions opts(lanms::IOU_CLIPPER);
+	size_t passes = 1;
+	std::vector<std::string> paths;
+	for (int i = 1; i < argc; i ++) {
+		if (std::strcmp(argv[i], "-k") == 0 && i + 1 < argc) {
+			std::string kernel = argv[++ i];
+			if (kernel != "clipper" && kernel != "convex_quad") {
+				std::fprintf(stderr, "unknown IoU kernel %s\n", kernel.c_str());
+				return 1;
+			}
+			opts.kernel = kernel == "clipper" ? lanms::IOU_CLIPPER : lanms::IOU_CONVEX_QUAD;
+		} else if (std::strcmp(argv[i], "-p") == 0 && i + 1 < argc)
+			passes = std::max(1, std::atoi(argv[++ i]));
+		else
+			paths.push_back(argv[i]);
+	}
+	if (paths.empty()) {
+		std::fprintf(stderr, "usage: %s [-k clipper|convex_quad] [-p passes] record.bin ...\n", argv[0]);
+		return 1;
+	}
+
+	// load everything first, so the replay is not bound by I/O
+	std::vector<lanms::record::Frame> frames;
+	for (auto &&path: paths)
+		if (!lanms::record::read_frames(path, frames)) {
+			std::fprintf(stderr, "cannot read record file %s\n", path.c_str());
+			return 1;
+		}
+	if (frames.empty()) {
+		std::fprintf(stderr, "no frames recorded\n");
+		return 1;
+	}
+
+	// the stages of eval.detect; `nms` merges the recorded pre-NMS boxes,
+	// `fused` decodes and merges in one pass as detect does
+	Stage decode{"decode", {}}, nms{"nms", {}}, fused{"fused", {}}, rescore{"rescore", {}}, total{"total", {}};
+	lanms::Workspace ws;
+	std::vector<float> candidates, boxes;
+	size_t nr_candidates = 0, nr_boxes = 0;
+	for (size_t pass = 0; pass < passes; pass ++)
+		for (auto &&frame: frames) {
+			auto &hd = frame.header;
+			decode.time([&]() {
+				candidates.clear();
+				lanms::restore_rbox_maps(frame.score.data(), frame.geo.data(), hd.h, hd.w,
+						hd.score_map_thresh, hd.scale, candidates);
+			});
+			nms.time([&]() {
+				lanms::merge_quadrangle_n9(frame.boxes.data(), hd.n, hd.nms_thres, opts, ws);
+			});
+			fused.time([&]() {
+				lanms::merge_rbox_maps(frame.score.data(), frame.geo.data(), hd.h, hd.w,
+						hd.score_map_thresh, hd.nms_thres, hd.scale, opts, ws);
+			});
+			rescore.time([&]() {
+				boxes.resize(ws.out.size() * 9);
+				for (size_t i = 0; i < ws.out.size(); i ++) {
+					auto &p = ws.out[i];
+					for (size_t j = 0; j < 4; j ++) {
+						boxes[i * 9 + j * 2] = p.poly.x[j];
+						boxes[i * 9 + j * 2 + 1] = p.poly.y[j];
+					}
+					boxes[i * 9 + 8] = p.score;
+				}
+				lanms::rescore_quadrangle_n9(boxes.data(), ws.out.size(), frame.score.data(), hd.h, hd.w,
+						int(hd.scale));
+				size_t kept = 0;
+				for (size_t i = 0; i < ws.out.size(); i ++)
+					if (boxes[i * 9 + 8] > hd.box_thresh)
+						std::copy_n(&boxes[i * 9], 9, &boxes[kept ++ * 9]);
+				boxes.resize(kept * 9);
+			});
+			// what detect spends on the frame
+			total.samples.push_back(fused.samples.back() + rescore.samples.back());
+			nr_candidates += candidates.size() / 9;
+			nr_boxes += boxes.size() / 9;
+		}
+	double elapsed = 0;
+	for (double s: total.samples)
+		elapsed += s;
+
+	size_t n = frames.size() * passes;
+	std::printf("%zu frames, %.1f candidates and %.1f boxes per frame, %.1f frames/s\n",
+			n, double(nr_candidates) / n, double(nr_boxes) / n, n / elapsed);
+	std::printf("%-10s %9s %9s %9s %9s %9s   (ms)\n", "stage", "mean", "p50", "p90", "p99", "max");
+	for (auto stage: {&decode, &nms, &fused, &rescore, &total})
+		stage->print();
+	return 0;
+}
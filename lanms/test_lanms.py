@@ -0,0 +1,108 @@
+'''
+equivalence tests: the parallel, reusable and streaming entry points must
+return what the serial merge_quadrangle_n9 returns on the same input
+
+    python -m unittest lanms.test_lanms
+'''
+import unittest
+import numpy as np
+
+import lanms
+
+THRES = 0.3
+
+
+def workloads(n, seeds=2):
+    '''
+    the synthetic clouds of lanms/bench
+    :return: list of (name, n*9 y-sorted candidates)
+    '''
+    return [('{}#{}'.format(name, seed), lanms.synthetic_workload(name, n, seed))
+            for name in lanms.WORKLOADS for seed in range(seeds)]
+
+
+def sort_rows(polys):
+    '''
+    the rows of an n*9 array in lexicographic order, for outputs that hold
+    the same quadrangles in a different order
+    '''
+    polys = np.asarray(polys).reshape((-1, 9))
+    return polys[np.lexsort(polys.T[::-1])]
+
+
+class BitmaskTest(unittest.TestCase):
+
+    def test_same_as_sequential(self):
+        for name, polys in workloads(2000):
+            ref = lanms.merge_quadrangle_n9(polys, THRES)
+            for num_threads in (1, 4):
+                out = lanms.merge_quadrangle_n9(polys, THRES, nms_mode='bitmask', num_threads=num_threads)
+                np.testing.assert_array_equal(out, ref, err_msg=name)
+
+    def test_max_output(self):
+        for name, polys in workloads(2000):
+            ref = lanms.merge_quadrangle_n9(polys, THRES, max_output=10)
+            out = lanms.merge_quadrangle_n9(polys, THRES, nms_mode='bitmask', num_threads=4, max_output=10)
+            np.testing.assert_array_equal(out, ref, err_msg=name)
+
+
+class StripedLocalityTest(unittest.TestCase):
+
+    def test_same_as_serial(self):
+        # the quadrangle pass cuts stripes of at least 4096 candidates
+        for name, polys in workloads(20000):
+            ref = lanms.merge_quadrangle_n9(polys, THRES)
+            out = lanms.merge_quadrangle_n9(polys, THRES, parallel_locality=True, num_threads=4)
+            np.testing.assert_array_equal(out, ref, err_msg=name)
+
+
+class WorkspaceTest(unittest.TestCase):
+
+    def test_same_as_serial(self):
+        ws = lanms.Workspace()
+        for name, polys in workloads(2000):
+            ref = lanms.merge_quadrangle_n9(polys, THRES)
+            out = lanms.merge_quadrangle_n9(polys, THRES, workspace=ws)
+            np.testing.assert_array_equal(out, ref, err_msg=name)
+
+    def test_kept_result_stays_valid(self):
+        ws = lanms.Workspace()
+        (name, first), (_, second) = workloads(2000, seeds=2)[:2]
+        ref = lanms.merge_quadrangle_n9(first, THRES)
+        out = lanms.merge_quadrangle_n9(first, THRES, workspace=ws)
+        lanms.merge_quadrangle_n9(second, THRES, workspace=ws)
+        np.testing.assert_array_equal(out, ref, err_msg=name)
+
+
+class IncrementalTest(unittest.TestCase):
+
+    def test_same_as_serial(self):
+        for name, polys in workloads(2000):
+            ref = lanms.merge_quadrangle_n9(polys, THRES)
+            nms = lanms.IncrementalNMS(THRES)
+            # top of the highest candidate from each one on
+            tops = np.minimum.accumulate(polys[::-1, 1:8:2].min(axis=1))[::-1]
+            bounds = np.linspace(0, len(polys), 8).astype(int)
+            out = []
+            for begin, end in zip(bounds[:-1], bounds[1:]):
+                frontier = tops[end] if end < len(polys) else float('inf')
+                out.append(nms.push(polys[begin:end], frontier=frontier))
+            out.append(nms.finish())
+            np.testing.assert_array_equal(sort_rows(np.concatenate(out)), sort_rows(ref), err_msg=name)
+
+
+class TemporalTest(unittest.TestCase):
+
+    def test_first_frame_same_as_serial(self):
+        nms = lanms.TemporalNMS(THRES)
+        for name, polys in workloads(2000):
+            # without tracks every candidate goes through both passes
+            nms.reset()
+            ref = lanms.merge_quadrangle_n9(polys, THRES)
+            out, ids = nms.update(polys)
+            np.testing.assert_array_equal(sort_rows(out), sort_rows(ref), err_msg=name)
+            self.assertEqual(len(set(ids)), len(ids))
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace lanms {
+
+	/**
+	 * A process-wide pool of worker threads. Workers are started on first
+	 * use, kept alive between calls and only ever added, so steady-state
+	 * calls do not pay for thread creation. Any number of threads may call
+	 * run() concurrently.
+	 */
+	class ThreadPool {
+		public:
+			static ThreadPool &instance() {
+				static ThreadPool pool;
+				return pool;
+			}
+
+			/**
+			 * Call task(i) for every i in [0, n), using up to num_threads
+			 * threads including the calling one, and wait for all of them.
+			 * The first exception thrown by a task is rethrown here.
+			 */
+			void run(size_t n, size_t num_threads, const std::function<void(size_t)> &task) {
+				if (n == 0)
+					return;
+				num_threads = std::min(std::max<size_t>(num_threads, 1), n);
+				if (num_threads == 1) {
+					for (size_t i = 0; i < n; i ++)
+						task(i);
+					return;
+				}
+
+				// helpers may only get scheduled after the caller is done with
+				// every task, so the job state is shared rather than on the stack
+				auto job = std::make_shared<Job>(task, n);
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					while (workers.size() < num_threads - 1)
+						workers.emplace_back([this]() { work_loop(); });
+					for (size_t t = 0; t < num_threads - 1; t ++)
+						queue.emplace_back([job]() { job->work(); });
+				}
+				wakeup.notify_all();
+
+				job->work();
+				std::unique_lock<std::mutex> lock(job->mutex);
+				job->finished.wait(lock, [&]() { return job->done == job->n; });
+				if (job->error)
+					std::rethrow_exception(job->error);
+			}
+
+			~ThreadPool() {
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					stopping = true;
+				}
+				wakeup.notify_all();
+				for (auto &&w: workers)
+					w.join();
+			}
+
+		private:
+			struct Job {
+				Job(const std::function<void(size_t)> &task, size_t n):
+					task(task), n(n), next(0), done(0) {}
+
+				void work() {
+					size_t i;
+					while ((i = next ++) < n) {
+						try {
+							task(i);
+						} catch (...) {
+							std::lock_guard<std::mutex> lock(mutex);
+							if (!error)
+								error = std::current_exception();
+						}
+						if (++ done == n) {
+							std::lock_guard<std::mutex> lock(mutex);
+							finished.notify_all();
+						}
+					}
+				}
+
+				std::function<void(size_t)> task;
+				size_t n;
+				std::atomic<size_t> next, done;
+				std::mutex mutex;
+				std::condition_variable finished;
+				std::exception_ptr error;
+			};
+
+			ThreadPool(): stopping(false) {}
+
+			void work_loop() {
+				for (;;) {
+					std::function<void()> item;
+					{
+						std::unique_lock<std::mutex> lock(mutex);
+						wakeup.wait(lock, [&]() { return stopping || !queue.empty(); });
+						if (stopping)
+							return;
+						item = std::move(queue.front());
+						queue.pop_front();
+					}
+					item();
+				}
+			}
+
+			std::mutex mutex;
+			std::condition_variable wakeup;
+			std::deque<std::function<void()>> queue;
+			std::vector<std::thread> workers;
+			bool stopping;
+	};
+}
@@ -0,0 +1,177 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unistd.h>
+
+namespace lanms {
+
+	/**
+	 * Process-wide timeline of named spans, shared with Python through the
+	 * adaptor, and dumped as Chrome trace-event JSON (chrome://tracing,
+	 * Perfetto).
+	 *
+	 * Spans go into a fixed ring buffer that keeps the most recent ones, so
+	 * tracing can stay on in production and be dumped when a request turns
+	 * out slow. Recording is lock-free; while tracing is off a Span costs
+	 * one relaxed atomic load.
+	 */
+	namespace trace {
+
+		class Tracer {
+			public:
+				static Tracer &instance() {
+					static Tracer tracer;
+					return tracer;
+				}
+
+				/**
+				 * Start recording. The ring buffer is allocated by the first
+				 * call and keeps `capacity` (rounded up to a power of two)
+				 * spans; later calls do not resize it.
+				 */
+				void enable(size_t capacity = 1 << 16) {
+					{
+						std::lock_guard<std::mutex> lock(mutex);
+						if (!slots) {
+							size_t n = 1;
+							while (n < capacity)
+								n <<= 1;
+							slots.reset(new Slot[n]);
+							mask = n - 1;
+						}
+					}
+					on.store(true, std::memory_order_release);
+				}
+
+				void disable() {
+					on.store(false, std::memory_order_relaxed);
+				}
+
+				bool enabled() const {
+					return on.load(std::memory_order_relaxed);
+				}
+
+				static std::uint64_t now() {
+					return std::uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+								std::chrono::steady_clock::now().time_since_epoch()).count());
+				}
+
+				/**
+				 * Small id of the calling thread, stable for its lifetime.
+				 */
+				static std::uint32_t thread_id() {
+					static std::atomic<std::uint32_t> next(1);
+					thread_local std::uint32_t id = next.fetch_add(1, std::memory_order_relaxed);
+					return id;
+				}
+
+				/**
+				 * Record a span of the calling thread, [begin, end) in now()
+				 * nanoseconds. `name` must outlive the tracer.
+				 */
+				void record(const char *name, std::uint64_t begin, std::uint64_t end) {
+					if (!on.load(std::memory_order_acquire))
+						return;
+					auto seq = next.fetch_add(1, std::memory_order_relaxed);
+					auto &slot = slots[seq & mask];
+					// odd while being written, so a concurrent dump skips it
+					slot.seq.store(seq * 2 + 1, std::memory_order_relaxed);
+					std::atomic_thread_fence(std::memory_order_release);
+					slot.name.store(name, std::memory_order_relaxed);
+					slot.begin.store(begin, std::memory_order_relaxed);
+					slot.end.store(end, std::memory_order_relaxed);
+					slot.tid.store(thread_id(), std::memory_order_relaxed);
+					slot.seq.store(seq * 2 + 2, std::memory_order_release);
+				}
+
+				/**
+				 * The buffered spans ending at or after `since`, as Chrome
+				 * trace-event JSON. Spans being written meanwhile are left out.
+				 */
+				std::string dump(std::uint64_t since = 0) const {
+					std::string ret = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+					std::lock_guard<std::mutex> lock(mutex);
+					if (slots) {
+						auto end = next.load(std::memory_order_acquire);
+						auto begin = end > mask + 1 ? end - mask - 1 : 0;
+						bool first = true;
+						char buf[128];
+						int pid = int(getpid());
+						for (auto seq = begin; seq < end; seq ++) {
+							auto &slot = slots[seq & mask];
+							if (slot.seq.load(std::memory_order_acquire) != seq * 2 + 2)
+								continue;
+							auto name = slot.name.load(std::memory_order_relaxed);
+							auto t0 = slot.begin.load(std::memory_order_relaxed);
+							auto t1 = slot.end.load(std::memory_order_relaxed);
+							auto tid = slot.tid.load(std::memory_order_relaxed);
+							std::atomic_thread_fence(std::memory_order_acquire);
+							if (slot.seq.load(std::memory_order_relaxed) != seq * 2 + 2 || t1 < since)
+								continue;
+
+							ret += first ? "{\"name\":\"" : ",{\"name\":\"";
+							first = false;
+							for (auto c = name; *c; c ++) {
+								if (*c == '"' || *c == '\\')
+									ret += '\\';
+								ret += *c;
+							}
+							std::snprintf(buf, sizeof(buf),
+									"\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%u}",
+									t0 / 1e3, (t1 - t0) / 1e3, pid, unsigned(tid));
+							ret += buf;
+						}
+					}
+					ret += "]}";
+					return ret;
+				}
+
+			private:
+				Tracer(): mask(0), next(0), on(false) {}
+
+				struct Slot {
+					Slot(): seq(0), name(nullptr), begin(0), end(0), tid(0) {}
+
+					std::atomic<std::uint64_t> seq;
+					std::atomic<const char *> name;
+					std::atomic<std::uint64_t> begin, end;
+					std::atomic<std::uint32_t> tid;
+				};
+
+				std::unique_ptr<Slot[]> slots;
+				std::uint64_t mask;
+				std::atomic<std::uint64_t> next;
+				std::atomic<bool> on;
+				// guards the allocation of slots
+				mutable std::mutex mutex;
+		};
+
+		/**
+		 * Records the lifetime of the object as a span named `name`, if
+		 * tracing is on when it is created.
+		 */
+		class Span {
+			public:
+				Span(const char *name):
+					name(name), begin(Tracer::instance().enabled() ? Tracer::now() : 0) {}
+
+				~Span() {
+					if (begin)
+						Tracer::instance().record(name, begin, Tracer::now());
+				}
+
+			private:
+				Span(const Span &);
+				Span &operator=(const Span &);
+
+				const char *name;
+				std::uint64_t begin;
+		};
+	}
+}
@@ -0,0 +1,136 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace lanms {
+
+	/**
+	 * Synthetic EAST-like candidate clouds, shared by the benchmarks and,
+	 * through the Python module, by nms_diff.py, so both measure the same
+	 * inputs.
+	 *
+	 * A workload is an n-by-9 float array of quadrangles and scores in the
+	 * row-major order EAST emits them, i.e. sorted by y as
+	 * merge_quadrangle_n9 expects.
+	 */
+	namespace workload {
+
+		typedef std::vector<std::pair<float, std::vector<float>>> Candidates;
+
+		/**
+		 * Candidates of one text instance: every score map pixel (stride 4)
+		 * inside the rotated rectangle predicts the rectangle, with noise.
+		 */
+		void emit_instance(Candidates &cands, std::mt19937 &rng,
+				float cx, float cy, float w, float h, float angle, float noise) {
+			std::normal_distribution<float> jitter(0, noise);
+			std::uniform_real_distribution<float> score(0.8f, 1.f);
+			float c = std::cos(angle), s = std::sin(angle);
+			float dx[4] = {-w / 2, w / 2, w / 2, -w / 2}, dy[4] = {-h / 2, -h / 2, h / 2, h / 2};
+			float r = std::sqrt(w * w + h * h) / 2;
+			for (float py = std::floor((cy - r) / 4) * 4; py <= cy + r; py += 4)
+				for (float px = std::floor((cx - r) / 4) * 4; px <= cx + r; px += 4) {
+					// shrunk text region, as in the EAST score map
+					float u = (px - cx) * c + (py - cy) * s, v = -(px - cx) * s + (py - cy) * c;
+					if (std::abs(u) > w * 0.4f || std::abs(v) > h * 0.3f)
+						continue;
+					std::vector<float> q(9);
+					for (int k = 0; k < 4; k ++) {
+						q[k * 2] = cx + dx[k] * c - dy[k] * s + jitter(rng);
+						q[k * 2 + 1] = cy + dx[k] * s + dy[k] * c + jitter(rng);
+					}
+					q[8] = score(rng);
+					cands.emplace_back(py * 1e5f + px, std::move(q));
+				}
+		}
+
+		/**
+		 * Add text instances from `next` until there are n candidates, then
+		 * sort them as the score map is scanned.
+		 */
+		template<typename F>
+		std::vector<float> make(size_t n, unsigned seed, F &&next) {
+			std::mt19937 rng(seed);
+			Candidates cands;
+			while (cands.size() < n)
+				next(cands, rng);
+			cands.resize(n);
+			std::stable_sort(cands.begin(), cands.end(),
+					[](const Candidates::value_type &a, const Candidates::value_type &b) {
+						return a.first < b.first;
+					});
+			std::vector<float> ret;
+			ret.reserve(n * 9);
+			for (auto &&c: cands)
+				ret.insert(ret.end(), c.second.begin(), c.second.end());
+			return ret;
+		}
+
+		/**
+		 * Lines of small, nearly horizontal words, as on a document page.
+		 */
+		std::vector<float> dense_lines(size_t n, unsigned seed) {
+			std::uniform_real_distribution<float> U(0, 1);
+			return make(n, seed, [&](Candidates &cands, std::mt19937 &rng) {
+				float y = 20 + U(rng) * 680, h = 12 + U(rng) * 8, angle = (U(rng) - 0.5f) * 0.05f;
+				for (float x = 10 + U(rng) * 40; x < 1240; ) {
+					float w = h * (2 + U(rng) * 5);
+					emit_instance(cands, rng, x + w / 2, y, w, h, angle, 0.8f);
+					x += w + h * 0.6f;
+				}
+			});
+		}
+
+		/**
+		 * Few large words at steep angles, as on street signs.
+		 */
+		std::vector<float> rotated_signage(size_t n, unsigned seed) {
+			std::uniform_real_distribution<float> U(0, 1);
+			return make(n, seed, [&](Candidates &cands, std::mt19937 &rng) {
+				float h = 30 + U(rng) * 60, w = h * (1.5f + U(rng) * 4);
+				emit_instance(cands, rng, U(rng) * 1280, U(rng) * 720, w, h, (U(rng) - 0.5f) * 1.5f, 2.f);
+			});
+		}
+
+		/**
+		 * Isolated small words and single-pixel false positives.
+		 */
+		std::vector<float> sparse_scene(size_t n, unsigned seed) {
+			std::uniform_real_distribution<float> U(0, 1);
+			return make(n, seed, [&](Candidates &cands, std::mt19937 &rng) {
+				float cx = U(rng) * 1280, cy = U(rng) * 720;
+				if (U(rng) < 0.5f) {
+					float h = 10 + U(rng) * 20;
+					emit_instance(cands, rng, cx, cy, h * (1 + U(rng) * 3), h, (U(rng) - 0.5f) * 0.6f, 1.f);
+				} else {
+					// a lone pixel firing: one candidate of its own
+					emit_instance(cands, rng, std::floor(cx / 4) * 4, std::floor(cy / 4) * 4, 20, 8, 0, 1.f);
+				}
+			});
+		}
+
+		// the generators, by name
+		const char *const NAMES[] = {"dense_lines", "rotated_signage", "sparse_scene"};
+
+		/**
+		 * Run the generator called `name` into `ret`; returns false for an
+		 * unknown name.
+		 */
+		bool generate(const std::string &name, size_t n, unsigned seed, std::vector<float> &ret) {
+			if (name == "dense_lines")
+				ret = dense_lines(n, seed);
+			else if (name == "rotated_signage")
+				ret = rotated_signage(n, seed);
+			else if (name == "sparse_scene")
+				ret = sparse_scene(n, seed);
+			else
+				return false;
+			return true;
+		}
+	}
+}
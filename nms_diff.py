@@ -0,0 +1,199 @@
+'''
+differential check of the lanms NMS against the shapely reference in
+locality_aware_nms.py: both run on the same randomised or recorded
+candidate sets, and every contestant is reported with the share of its
+output that matches the reference output by IoU, and its speed-up. The
+random sets come from lanms.synthetic_workload, the generators of
+lanms/bench. CPU only, no TensorFlow needed
+
+    python nms_diff.py [--sizes 100,1000] [--seeds 3] [record.bin | dump.f32 ...]
+    python nms_diff.py --contestant mymodule:my_nms
+
+A contestant is a function (polys, thres) -> n*9 array, called with
+y-sorted n*9 float32 candidates like lanms.merge_quadrangle_n9.
+'''
+import argparse
+import collections
+import importlib
+import math
+import os
+import sys
+import time
+import numpy as np
+
+import locality_aware_nms as nms_locality
+import lanms
+
+CONTESTANTS = collections.OrderedDict()
+
+
+def contestant(name):
+    '''
+    register the decorated function as a contestant
+    '''
+    def register(f):
+        CONTESTANTS[name] = f
+        return f
+    return register
+
+
+@contestant('lanms')
+def lanms_clipper(polys, thres):
+    return lanms.merge_quadrangle_n9(polys, thres)
+
+
+@contestant('lanms/convex_quad')
+def lanms_convex_quad(polys, thres):
+    return lanms.merge_quadrangle_n9(polys, thres, iou_kernel='convex_quad')
+
+
+@contestant('lanms/bitmask')
+def lanms_bitmask(polys, thres):
+    return lanms.merge_quadrangle_n9(polys, thres, nms_mode='bitmask')
+
+
+@contestant('lanms/parallel_locality')
+def lanms_parallel_locality(polys, thres):
+    return lanms.merge_quadrangle_n9(polys, thres, parallel_locality=True)
+
+
+def load_contestant(spec):
+    '''
+    :param spec: module:function, with the module on the python path
+    '''
+    module, _, func = spec.partition(':')
+    if not func:
+        raise ValueError('contestant must be given as module:function, got {}'.format(spec))
+    return getattr(importlib.import_module(module), func)
+
+
+def load_workloads(path, thres):
+    '''
+    :param path: a record file of lanms.RecordWriter, each frame of which is
+        a workload with the threshold it was recorded with, or a raw float32
+        n*9 box dump
+    :return: list of (name, polys, thres)
+    '''
+    name = os.path.basename(path)
+    with open(path, 'rb') as f:
+        is_record = f.read(len(lanms.RecordWriter.MAGIC)) == lanms.RecordWriter.MAGIC
+    if is_record:
+        return [('{}#{}'.format(name, i), frame['boxes'], frame['nms_thres'])
+                for i, frame in enumerate(lanms.read_records(path))]
+    return [(name, np.fromfile(path, dtype='<f4').reshape((-1, 9)), thres)]
+
+
+def match(ref, out, match_iou):
+    '''
+    pair the boxes of two NMS outputs one to one, greedily by IoU
+    :return: list of (ref index, out index, iou)
+    '''
+    if len(ref) == 0 or len(out) == 0:
+        return []
+    # only overlapping bounding boxes can reach the threshold
+    lo_r, hi_r = ref[:, 0:8:2].min(1), ref[:, 0:8:2].max(1)
+    lo_o, hi_o = out[:, 0:8:2].min(1), out[:, 0:8:2].max(1)
+    top_r, bot_r = ref[:, 1:8:2].min(1), ref[:, 1:8:2].max(1)
+    top_o, bot_o = out[:, 1:8:2].min(1), out[:, 1:8:2].max(1)
+    overlap = ((lo_r[:, None] <= hi_o[None]) & (lo_o[None] <= hi_r[:, None]) &
+               (top_r[:, None] <= bot_o[None]) & (top_o[None] <= bot_r[:, None]))
+    pairs = []
+    for i, j in zip(*np.nonzero(overlap)):
+        iou = nms_locality.intersection(ref[i].astype(np.float64), out[j].astype(np.float64))
+        if iou >= match_iou:
+            pairs.append((iou, i, j))
+    pairs.sort(reverse=True)
+    used_r, used_o, ret = set(), set(), []
+    for iou, i, j in pairs:
+        if i not in used_r and j not in used_o:
+            used_r.add(i)
+            used_o.add(j)
+            ret.append((i, j, iou))
+    return ret
+
+
+def best_time(f, repeat):
+    ret, best = None, float('inf')
+    for _ in range(repeat):
+        start = time.time()
+        ret = f()
+        best = min(best, time.time() - start)
+    return ret, best
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n\n')[0])
+    parser.add_argument('dumps', nargs='*',
+                        help='record files or raw float32 n*9 box dumps to check instead of random workloads')
+    parser.add_argument('--sizes', default='100,1000', help='candidates per random workload')
+    parser.add_argument('--seeds', default=3, type=int, help='random workloads per generator and size')
+    parser.add_argument('--thres', default=0.2, type=float, help='NMS threshold of random workloads and dumps')
+    parser.add_argument('--match_iou', default=0.9, type=float,
+                        help='IoU at which a box counts as agreeing with a reference box')
+    parser.add_argument('--repeat', default=5, type=int, help='contestant runs per workload; the best is timed')
+    parser.add_argument('--contestant', action='append', default=[],
+                        help='module:function to check as well; may be repeated')
+    parser.add_argument('--only', action='store_true', help='check the --contestant functions only')
+    parser.add_argument('--min_agreement', default=0.98, type=float,
+                        help='exit with 1 if a contestant agrees on fewer boxes overall')
+    args = parser.parse_args()
+
+    contestants = collections.OrderedDict() if args.only else collections.OrderedDict(CONTESTANTS)
+    for spec in args.contestant:
+        contestants[spec] = load_contestant(spec)
+
+    workloads = []
+    for path in args.dumps:
+        workloads += load_workloads(path, args.thres)
+    if not args.dumps:
+        for n in [int(s) for s in args.sizes.split(',')]:
+            for gen in lanms.WORKLOADS:
+                for seed in range(args.seeds):
+                    workloads.append(('{}/{}#{}'.format(gen, n, seed),
+                                      lanms.synthetic_workload(gen, n, seed), args.thres))
+
+    # per contestant: matched, reference, output and compared boxes, log speed-ups
+    totals = collections.OrderedDict((name, [0, 0, 0, 0, []]) for name in contestants)
+    print('{:<28} {:<24} {:>6} {:>6} {:>6} {:>7} {:>8} {:>9} {:>10} {:>9}'.format(
+        'workload', 'contestant', 'ref', 'out', 'match', 'agree', 'mean iou', 'score err',
+        'ref ms', 'speed-up'))
+    for name, polys, thres in workloads:
+        polys = np.ascontiguousarray(polys, dtype=np.float32).reshape((-1, 9))
+        # the reference merges in place, and computes in double precision
+        start = time.time()
+        ref = np.array(nms_locality.nms_locality(polys.astype(np.float64), thres)).reshape((-1, 9))
+        ref_time = time.time() - start
+        for cname, f in contestants.items():
+            f(polys.copy(), thres)  # warm up
+            out, out_time = best_time(lambda: np.array(f(polys.copy(), thres)).reshape((-1, 9)), args.repeat)
+            pairs = match(ref, out, args.match_iou)
+            denom = max(len(ref), len(out))
+            agree = float(len(pairs)) / denom if denom else 1.
+            mean_iou = np.mean([iou for _, _, iou in pairs]) if pairs else float('nan')
+            # merging sums the scores, so they reveal merges in a different order
+            score_err = max([abs(out[j, 8] - ref[i, 8]) / max(abs(ref[i, 8]), 1e-6)
+                             for i, j, _ in pairs] or [0.])
+            speedup = ref_time / max(out_time, 1e-9)
+            print('{:<28} {:<24} {:>6} {:>6} {:>6} {:>7.4f} {:>8.4f} {:>9.2e} {:>10.2f} {:>8.1f}x'.format(
+                name, cname, len(ref), len(out), len(pairs), agree, mean_iou, score_err,
+                ref_time * 1e3, speedup))
+            t = totals[cname]
+            t[0] += len(pairs)
+            t[1] += len(ref)
+            t[2] += len(out)
+            t[3] += denom
+            t[4].append(math.log(speedup))
+
+    failed = False
+    print('\n{:<24} {:>8} {:>8} {:>8} {:>9} {:>16}'.format(
+        'contestant', 'ref', 'out', 'match', 'agree', 'geomean speed-up'))
+    for cname, (matched, nr_ref, nr_out, denom, log_speedups) in totals.items():
+        agree = float(matched) / denom if denom else 1.
+        failed |= agree < args.min_agreement
+        print('{:<24} {:>8} {:>8} {:>8} {:>9.4f} {:>15.1f}x'.format(
+            cname, nr_ref, nr_out, matched, agree, math.exp(np.mean(log_speedups)) if log_speedups else 0))
+    return 1 if failed else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
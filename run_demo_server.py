@@ -34,7 +34,7 @@ def get_host_info():
 
 
 @functools.lru_cache(maxsize=100)
-def get_predictor(checkpoint_path):
+def get_predictor(checkpoint_path, record_path=None):
     logger.info('loading model')
     import tensorflow as tf
     import model
@@ -57,6 +57,9 @@ def get_predictor(checkpoint_path):
     logger.info('Restore from {}'.format(model_path))
     saver.restore(sess, model_path)
 
+    # dumps the post-processing inputs of every request, for lanms/replay
+    recorder = lanms.RecordWriter(record_path) if record_path else None
+
     def predictor(img):
         """
         :return: {
@@ -76,12 +79,16 @@ def get_predictor(checkpoint_path):
             },
             'timing': {
                 'net': ,
-                'restore': ,
                 'nms': ,
                 'cpuinfo': ,
                 'meminfo': ,
                 'uptime': ,
-            }
+            },
+            'nms_stats': {  # see lanms.merge_quadrangle_n9
+                'input': ,
+                'iou_evals': ,
+                ...
+            },
         }
         """
         start_time = time.time()
@@ -90,22 +97,26 @@ def get_predictor(checkpoint_path):
         rtparams['image_size'] = '{}x{}'.format(img.shape[1], img.shape[0])
         timer = collections.OrderedDict([
             ('net', 0),
-            ('restore', 0),
             ('nms', 0)
         ])
 
-        im_resized, (ratio_h, ratio_w) = resize_image(img)
+        with lanms.trace_span('resize'):
+            im_resized, (ratio_h, ratio_w) = resize_image(img)
         rtparams['working_size'] = '{}x{}'.format(
             im_resized.shape[1], im_resized.shape[0])
         start = time.time()
-        score, geometry = sess.run(
-            [f_score, f_geometry],
-            feed_dict={input_images: [im_resized[:,:,::-1]]})
+        with lanms.trace_span('sess.run'):
+            score, geometry = sess.run(
+                [f_score, f_geometry],
+                feed_dict={input_images: [im_resized[:,:,::-1]]})
         timer['net'] = time.time() - start
 
-        boxes, timer = detect(score_map=score, geo_map=geometry, timer=timer)
-        logger.info('net {:.0f}ms, restore {:.0f}ms, nms {:.0f}ms'.format(
-            timer['net']*1000, timer['restore']*1000, timer['nms']*1000))
+        nms_stats = {}
+        with lanms.trace_span('detect'):
+            boxes, timer = detect(score_map=score, geo_map=geometry, timer=timer, recorder=recorder,
+                                  nms_stats=nms_stats)
+        logger.info('net {:.0f}ms, nms {:.0f}ms'.format(
+            timer['net']*1000, timer['nms']*1000))
 
         if boxes is not None:
             scores = boxes[:,8].reshape(-1)
@@ -133,6 +144,7 @@ def get_predictor(checkpoint_path):
             'text_lines': text_lines,
             'rtparams': rtparams,
             'timing': timer,
+            'nms_stats': nms_stats,
         }
         ret.update(get_host_info())
         return ret
@@ -193,28 +205,56 @@ def save_result(img, rst):
 
 
 checkpoint_path = './east_icdar2015_resnet_v1_50_rbox'
+record_path = None
+# requests slower than this keep their trace next to their result; 0 disables tracing
+trace_slo_ms = 0
 
 
 @app.route('/', methods=['POST'])
 def index_post():
     global predictor
     import io
+    import lanms
+    begin = lanms.trace_now()
     bio = io.BytesIO()
     request.files['image'].save(bio)
-    img = cv2.imdecode(np.frombuffer(bio.getvalue(), dtype='uint8'), 1)
-    rst = get_predictor(checkpoint_path)(img)
+    with lanms.trace_span('decode'):
+        img = cv2.imdecode(np.frombuffer(bio.getvalue(), dtype='uint8'), 1)
+    with lanms.trace_span('predict'):
+        rst = get_predictor(checkpoint_path, record_path)(img)
 
     save_result(img, rst)
+    if trace_slo_ms and (lanms.trace_now() - begin) / 1e6 > trace_slo_ms:
+        lanms.trace_dump(os.path.join(config.SAVE_DIR, rst['session_id'], 'trace.json'), since=begin)
     return render_template('index.html', session_id=rst['session_id'])
 
 
+@app.route('/trace')
+def trace():
+    '''
+    the latest spans of every request, as Chrome trace-event JSON
+    '''
+    import lanms
+    return app.response_class(lanms.trace_dump(), mimetype='application/json')
+
+
 def main():
-    global checkpoint_path
+    global checkpoint_path, record_path, trace_slo_ms
     parser = argparse.ArgumentParser()
     parser.add_argument('--port', default=8769, type=int)
     parser.add_argument('--checkpoint_path', default=checkpoint_path)
+    parser.add_argument('--record_path', default=None,
+                        help='append the post-processing inputs of every request to this record file')
+    parser.add_argument('--trace_slo_ms', default=0, type=float,
+                        help='trace every request, and save the trace of those slower than this; '
+                             'the latest spans are always served at /trace')
     args = parser.parse_args()
     checkpoint_path = args.checkpoint_path
+    record_path = args.record_path
+    trace_slo_ms = args.trace_slo_ms
+    if trace_slo_ms:
+        import lanms
+        lanms.trace_enable()
 
     if not os.path.exists(args.checkpoint_path):
         raise RuntimeError(